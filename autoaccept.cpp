@@ -25,9 +25,21 @@
  */
 
 #include <znc/IRCNetwork.h>
+#include <znc/IRCSock.h>
 #include <znc/Modules.h>
 
+#include <list>
+#include <unordered_map>
+
+#include "hostmask.h"
+
 #define MESSAGE "You have been /accept'ed. Please send again."
+// Size of the accept list when the server doesn't tell us with ACCEPT=
+#define ACCEPT_LIMIT 20
+// Keep ACCEPT a,b,c lines well below the 512 byte limit
+#define ACCEPT_LINE_LEN 400
+// Seconds to wait for the end of the ACCEPT * reply before giving up on it
+#define SYNC_TIMEOUT 30
 
 using std::map;
 using std::set;
@@ -35,69 +47,68 @@ using std::vector;
 
 class CAutoAcceptMod;
 
-class CAutoAcceptUser {
+class CAcceptSyncTimer : public CTimer {
   public:
-    CAutoAcceptUser() {}
+    CAcceptSyncTimer(CAutoAcceptMod* pMod);
+    ~CAcceptSyncTimer() override {}
 
-    CAutoAcceptUser(const CString& sLine) { FromString(sLine); }
+    void RunJob() override;
 
-    CAutoAcceptUser(const CString& sUsername, const CString& sHostmasks)
-        : m_sUsername(sUsername) {
-        AddHostmasks(sHostmasks);
-    }
-
-    virtual ~CAutoAcceptUser() {}
+  private:
+    CAutoAcceptMod* m_pMod;
+};
 
-    const CString& GetUsername() const { return m_sUsername; }
+// Nicks we know are on the server's accept list, least recently seen last
+class CAcceptCache {
+  public:
+    // Moves a known nick to the front, false if we don't know it
+    bool Touch(const CString& sNick) {
+        auto it = m_mNicks.find(sNick.AsLower());
+        if (it == m_mNicks.end()) return false;
 
-    bool HostMatches(const CString& sHostmask) {
-        for (const CString& s : m_ssHostmasks) {
-            if (sHostmask.WildCmp(s, CString::CaseInsensitive)) {
-                return true;
-            }
-        }
-        return false;
+        m_lNicks.splice(m_lNicks.begin(), m_lNicks, it->second);
+        return true;
     }
 
-    CString GetHostmasks() const {
-        return CString(",").Join(m_ssHostmasks.begin(), m_ssHostmasks.end());
-    }
+    // Returns the nick that had to make room, if any
+    CString Add(const CString& sNick) {
+        if (Touch(sNick)) return "";
 
-    bool DelHostmasks(const CString& sHostmasks) {
-        VCString vsHostmasks;
-        sHostmasks.Split(",", vsHostmasks);
+        m_lNicks.push_front(sNick);
+        m_mNicks[sNick.AsLower()] = m_lNicks.begin();
 
-        for (const CString& s : vsHostmasks) {
-            m_ssHostmasks.erase(s);
-        }
+        if (m_lNicks.size() <= m_uLimit) return "";
 
-        return m_ssHostmasks.empty();
+        CString sOldest = m_lNicks.back();
+        Del(sOldest);
+        return sOldest;
     }
 
-    void AddHostmasks(const CString& sHostmasks) {
-        VCString vsHostmasks;
-        sHostmasks.Split(",", vsHostmasks);
+    void Del(const CString& sNick) {
+        auto it = m_mNicks.find(sNick.AsLower());
+        if (it == m_mNicks.end()) return;
 
-        for (const CString& s : vsHostmasks) {
-            m_ssHostmasks.insert(s);
-        }
+        m_lNicks.erase(it->second);
+        m_mNicks.erase(it);
     }
 
-    CString ToString() const {
-        return m_sUsername + "\t" + GetHostmasks();
+    void Clear() {
+        m_lNicks.clear();
+        m_mNicks.clear();
     }
 
-    bool FromString(const CString& sLine) {
-        m_sUsername = sLine.Token(0, false, "\t");
-        // Trim because there was a bug which caused spaces in the hostname
-        sLine.Token(1, false, "\t").Trim_n().Split(",", m_ssHostmasks);
-        return true;
+    bool Has(const CString& sNick) const {
+        return m_mNicks.count(sNick.AsLower()) > 0;
     }
 
+    void SetLimit(size_t uLimit) { m_uLimit = std::max<size_t>(1, uLimit); }
+    size_t GetLimit() const { return m_uLimit; }
+    size_t size() const { return m_lNicks.size(); }
+
   private:
-  protected:
-    CString m_sUsername;
-    set<CString> m_ssHostmasks;
+    std::list<CString> m_lNicks;
+    std::unordered_map<std::string, std::list<CString>::iterator> m_mNicks;
+    size_t m_uLimit = ACCEPT_LIMIT;
 };
 
 class CAutoAcceptMod : public CModule {
@@ -112,56 +123,215 @@ class CAutoAcceptMod : public CModule {
     }
 
     bool OnLoad(const CString& sArgs, CString& sMessage) override {
-        // Load the users
-        for (MCString::iterator it = BeginNV(); it != EndNV(); ++it) {
-            const CString& sLine = it->second;
-            CAutoAcceptUser* pUser = new CAutoAcceptUser;
-
-            if (!pUser->FromString(sLine) ||
-                FindUser(pUser->GetUsername().AsLower())) {
-                delete pUser;
-            } else {
-                m_msUsers[pUser->GetUsername().AsLower()] = pUser;
+        m_Users.Load(this);
+
+        // Past registration ISUPPORT is known already
+        if (GetNetwork()->IsIRCConnected()) OnISupport();
+
+        return true;
+    }
+
+    // 001 comes before the 005 lines, so ISUPPORT is only read once the
+    // server is done with them and sends the MOTD (376 or 422)
+    void OnISupport() {
+        CIRCSock* pIRCSock = GetNetwork()->GetIRCSock();
+        CString sLimit = pIRCSock->GetISupport("ACCEPT");
+        m_Accepted.SetLimit(sLimit.empty() ? ACCEPT_LIMIT : sLimit.ToUInt());
+
+        // Once per connection, /motd ends with 376 as well
+        if (m_bReady) return;
+        m_bReady = true;
+
+        // Find out what is on the list already before adding to it
+        if (pIRCSock->GetISupport().count("CALLERID")) {
+            SyncAccepts();
+        } else {
+            FlushAccepts();
+        }
+    }
+
+    // The server forgets the accept list when we disconnect
+    void OnIRCDisconnected() override {
+        m_Accepted.Clear();
+        m_vsPending.clear();
+        m_vsSent.clear();
+        m_vsTell.clear();
+        m_bSyncing = false;
+        m_bReady = false;
+        RemTimer("AcceptSync");
+    }
+
+    // Asks for the whole list, the 281 replies fill the cache again
+    void SyncAccepts() {
+        if (m_bSyncing) return;
+
+        m_Accepted.Clear();
+        m_bSyncing = true;
+        PutIRC("ACCEPT *");
+        AddTimer(new CAcceptSyncTimer(this));
+    }
+
+    // No 282 came, so don't hold the queued nicks back forever
+    void SyncTimedOut() {
+        if (!m_bSyncing) return;
+
+        m_bSyncing = false;
+        m_vsSent.clear();
+        // Nobody is told without knowing the ACCEPT worked
+        m_vsTell.clear();
+        FlushAccepts();
+    }
+
+    // Queues a nick for FlushAccepts() unless it's on the list already
+    void Accept(const CString& sNick) {
+        if (m_Accepted.Touch(sNick) || IsPending(sNick)) return;
+        m_vsPending.push_back(sNick);
+    }
+
+    // Sends the queued nicks as ACCEPT a,b,c, making room for them with -nick
+    // before the server's limit is reached. If anyone waits to be told, the
+    // list is asked for again to see whose ACCEPT worked.
+    void FlushAccepts() {
+        if (!m_bReady || m_bSyncing) return;
+
+        CString sLine;
+        set<CString> ssAdded;
+
+        for (const CString& sNick : m_vsPending) {
+            if (m_Accepted.Touch(sNick)) continue;
+
+            CString sOldest = m_Accepted.Add(sNick);
+            CString sItems = sNick;
+            if (!sOldest.empty()) sItems = "-" + sOldest + "," + sNick;
+
+            // The server removes before it adds, so a nick this line added
+            // can only be removed again by the next line
+            bool bFull = sLine.length() + sItems.length() >= ACCEPT_LINE_LEN;
+            if (!sLine.empty() && (bFull || ssAdded.count(sOldest.AsLower()))) {
+                PutIRC("ACCEPT " + sLine);
+                sLine.clear();
+                ssAdded.clear();
+            }
+
+            if (!sLine.empty()) sLine += ",";
+            sLine += sItems;
+            ssAdded.insert(sNick.AsLower());
+
+            // Kept for a 456, which doesn't say which nick didn't fit
+            m_vsSent.push_back(sNick);
+            if (m_vsSent.size() > m_Accepted.GetLimit()) {
+                m_vsSent.erase(m_vsSent.begin());
             }
         }
 
-        return true;
+        if (!sLine.empty()) PutIRC("ACCEPT " + sLine);
+        m_vsPending.clear();
+
+        if (!m_vsTell.empty()) SyncAccepts();
+    }
+
+    // Tells the nicks that made it onto the list. The rest were queued again
+    // by a 456 and wait for the next list.
+    void TellAccepted() {
+        VCString vsWaiting;
+        for (const CString& sNick : m_vsTell) {
+            if (m_Accepted.Has(sNick)) {
+                PutIRC("PRIVMSG " + sNick + " :" MESSAGE);
+            } else if (IsPending(sNick)) {
+                vsWaiting.push_back(sNick);
+            }
+        }
+        m_vsTell.swap(vsWaiting);
     }
 
-    ~CAutoAcceptMod() override {
-        for (const auto& it : m_msUsers) {
-            delete it.second;
+    bool IsPending(const CString& sNick) const {
+        for (const CString& s : m_vsPending) {
+            if (s.Equals(sNick)) return true;
         }
-        m_msUsers.clear();
+        return false;
     }
 
     EModRet OnNumericMessage(CNumericMessage& numeric) {
+        // RPL_ENDOFMOTD and ERR_NOMOTD
+        if (numeric.GetCode() == 376 || numeric.GetCode() == 422) {
+            OnISupport();
+        }
         if (numeric.GetCode() == 718) {
-            for (const auto& it : m_msUsers) {
-                // Replace that space between "KindOne kindone@..." with a !.
-                // This makes the module work like auto(op|voice).cpp.
-                if (it.second->HostMatches(numeric.GetParam(1) + "!" + numeric.GetParam(2))) {
-                    // Inspircd + ratbox (efnet) do not automatically put users on the /accept list when you msg them.
-                    // Charybdis has done this since July 3rd / 4th 2010 with the two commits below.
-                    // 0770c9936ef1fc404f04fb4004adc8546abeba7a
-                    // f5455d2cd5e6dd5169ce8006167fffa8475bc493
-                    PutIRC("ACCEPT " + numeric.GetParam(1));
-                    PutIRC("PRIVMSG " + numeric.GetParam(1) + " :" MESSAGE);
-                    break;
+            // Replace that space between "KindOne kindone@..." with a !.
+            // This makes the module work like auto(op|voice).cpp.
+            if (m_Users.Find(numeric.GetParam(1) + "!" + numeric.GetParam(2))) {
+                // Inspircd + ratbox (efnet) do not automatically put users on the /accept list when you msg them.
+                // Charybdis has done this since July 3rd / 4th 2010 with the two commits below.
+                // 0770c9936ef1fc404f04fb4004adc8546abeba7a
+                // f5455d2cd5e6dd5169ce8006167fffa8475bc493
+                // They wouldn't be blocked if they were on the list, so
+                // whatever we thought we knew about them is stale.
+                const CString& sNick = numeric.GetParam(1);
+                m_Accepted.Del(sNick);
+                Accept(sNick);
+
+                // Only once the server lists them as accepted
+                bool bTold = false;
+                for (const CString& s : m_vsTell) {
+                    if (s.Equals(sNick)) bTold = true;
                 }
+                if (!bTold) m_vsTell.push_back(sNick);
+                FlushAccepts();
             }
         }
         // RPL_MONONLINE
         // :irc.freenode.net 730 KindOne :EvilOne!KindOne@1.2.3.4
         if (numeric.GetCode() == 730) {
-            for (const auto& it : m_msUsers) {
-                if (it.second->HostMatches(numeric.GetParam(1))) {
+            VCString vsTargets;
+            numeric.GetParam(1).Split(",", vsTargets, false);
+            vector<CHostmaskUser*> vpUsers = m_Users.FindEach(vsTargets);
+
+            for (size_t i = 0; i < vsTargets.size(); ++i) {
+                if (vpUsers[i]) {
                     // Borrowed from test/Nicktest.cpp
-                    CNick Nick1(numeric.GetParam(1));
-                    PutIRC("ACCEPT " + Nick1.GetNick());
-                    break;
+                    CNick Nick1(vsTargets[i]);
+                    Accept(Nick1.GetNick());
                 }
             }
+            FlushAccepts();
+        }
+        // RPL_ACCEPTLIST, from our own ACCEPT * or someone else's
+        // :irc.server 281 KindOne :EvilOne GoodOne
+        if (numeric.GetCode() == 281) {
+            for (unsigned int i = 1; i < numeric.GetParams().size(); ++i) {
+                VCString vsNicks;
+                numeric.GetParam(i).Split(" ", vsNicks, false);
+                for (const CString& sNick : vsNicks) m_Accepted.Add(sNick);
+            }
+            if (m_bSyncing) return HALT;
+        }
+        // RPL_ENDOFACCEPT, now we know what's on the list, and every ACCEPT
+        // sent before the ACCEPT * has been answered
+        if (numeric.GetCode() == 282 && m_bSyncing) {
+            m_bSyncing = false;
+            m_vsSent.clear();
+            RemTimer("AcceptSync");
+            TellAccepted();
+            FlushAccepts();
+            return HALT;
+        }
+        // ERR_ACCEPTFULL, our idea of the list was wrong. The server drops
+        // the rest of the line without naming the nick, so everything sent
+        // lately is queued again. Nicks that did make it are skipped by
+        // FlushAccepts() once the list is known.
+        if (numeric.GetCode() == 456) {
+            SyncAccepts();
+            VCString vsSent;
+            vsSent.swap(m_vsSent);
+            for (const CString& sNick : vsSent) Accept(sNick);
+        }
+        // ERR_ACCEPTEXIST and ERR_ACCEPTNOT
+        // :irc.server 457 KindOne EvilOne :is already on your accept list
+        if (numeric.GetCode() == 457) {
+            m_Accepted.Add(numeric.GetParam(1));
+        }
+        if (numeric.GetCode() == 458) {
+            m_Accepted.Del(numeric.GetParam(1));
         }
         return CONTINUE;
     }
@@ -172,12 +342,30 @@ class CAutoAcceptMod : public CModule {
         if (sNewNick == m_pNetwork->GetIRCNick().GetNick()) {
             return;
         }
-        for (const auto& it : m_msUsers) {
-            if (it.second->HostMatches(sNewNick + "!" + OldNick.GetIdent() + "@" + OldNick.GetHost())) {
-                PutIRC("ACCEPT " + sNewNick);
-                break;
+        if (m_Users.Find(sNewNick + "!" + OldNick.GetIdent() + "@" + OldNick.GetHost())) {
+            Accept(sNewNick);
+            FlushAccepts();
+        }
+    }
+
+    // Keep up with what the user accepts or removes by hand
+    EModRet OnUserRawMessage(CMessage& Message) override {
+        if (!Message.GetCommand().Equals("ACCEPT")) return CONTINUE;
+
+        VCString vsNicks;
+        Message.GetParam(0).Split(",", vsNicks, false);
+
+        for (const CString& sNick : vsNicks) {
+            if (sNick == "*") continue;
+
+            if (sNick.StartsWith("-")) {
+                m_Accepted.Del(sNick.substr(1));
+            } else {
+                m_Accepted.Add(sNick);
             }
         }
+
+        return CONTINUE;
     }
 
     void OnModCommand(const CString& sLine) override {
@@ -192,10 +380,10 @@ class CAutoAcceptMod : public CModule {
         if (sHost.empty()) {
             PutModule("Usage: AddUser <user> <hostmask>[,<hostmasks>...]");
         } else {
-            CAutoAcceptUser* pUser = AddUser(sUser, sHost);
+            CHostmaskUser* pUser = AddUser(sUser, sHost);
 
             if (pUser) {
-                SetNV(sUser, pUser->ToString());
+                m_Users.Save(this, pUser);
             }
         }
     }
@@ -212,7 +400,7 @@ class CAutoAcceptMod : public CModule {
     }
 
     void OnListUsersCommand(const CString& sLine) {
-        if (m_msUsers.empty()) {
+        if (m_Users.empty()) {
             PutModule("There are no users defined");
             return;
         }
@@ -222,7 +410,7 @@ class CAutoAcceptMod : public CModule {
         Table.AddColumn("User");
         Table.AddColumn("Hostmasks");
 
-        for (const auto& it : m_msUsers) {
+        for (const auto& it : m_Users.GetUsers()) {
             VCString vsHostmasks;
             it.second->GetHostmasks().Split(",", vsHostmasks);
             for (unsigned int a = 0; a < vsHostmasks.size(); a++) {
@@ -250,7 +438,7 @@ class CAutoAcceptMod : public CModule {
             return;
         }
 
-        CAutoAcceptUser* pUser = FindUser(sUser);
+        CHostmaskUser* pUser = FindUser(sUser);
 
         if (!pUser) {
             PutModule("No such user");
@@ -258,8 +446,9 @@ class CAutoAcceptMod : public CModule {
         }
 
         pUser->AddHostmasks(sHostmasks);
+        m_Users.Reindex();
         PutModule("Hostmasks(s) added to user [" + pUser->GetUsername() + "]");
-        SetNV(pUser->GetUsername(), pUser->ToString());
+        m_Users.Save(this, pUser);
     }
 
     void OnDelMasksCommand(const CString& sLine) {
@@ -271,7 +460,7 @@ class CAutoAcceptMod : public CModule {
             return;
         }
 
-        CAutoAcceptUser* pUser = FindUser(sUser);
+        CHostmaskUser* pUser = FindUser(sUser);
 
         if (!pUser) {
             PutModule("No such user");
@@ -283,59 +472,63 @@ class CAutoAcceptMod : public CModule {
             DelUser(sUser);
             DelNV(sUser);
         } else {
+            m_Users.Reindex();
             PutModule("Hostmasks(s) Removed from user [" + pUser->GetUsername() + "]");
-            SetNV(pUser->GetUsername(), pUser->ToString());
+            m_Users.Save(this, pUser);
         }
     }
 
-    CAutoAcceptUser* FindUser(const CString& sUser) {
-        map<CString, CAutoAcceptUser*>::iterator it =
-            m_msUsers.find(sUser.AsLower());
-
-        return (it != m_msUsers.end()) ? it->second : nullptr;
+    CHostmaskUser* FindUser(const CString& sUser) {
+        return m_Users.FindUser(sUser);
     }
 
-    CAutoAcceptUser* FindUserByHost(const CString& sHostmask) {
-        for (const auto& it : m_msUsers) {
-            CAutoAcceptUser* pUser = it.second;
-            if (pUser->HostMatches(sHostmask)) {
-                return pUser;
-            }
-        }
-
-        return nullptr;
+    CHostmaskUser* FindUserByHost(const CString& sHostmask) {
+        return m_Users.Find(sHostmask);
     }
 
     void DelUser(const CString& sUser) {
-        map<CString, CAutoAcceptUser*>::iterator it =
-            m_msUsers.find(sUser.AsLower());
-
-        if (it == m_msUsers.end()) {
+        if (!m_Users.DelUser(sUser)) {
             PutModule("That user does not exist");
             return;
         }
 
-        delete it->second;
-        m_msUsers.erase(it);
         PutModule("User [" + sUser + "] removed");
     }
 
-    CAutoAcceptUser* AddUser(const CString& sUser, const CString& sHosts) {
-        if (m_msUsers.find(sUser) != m_msUsers.end()) {
+    CHostmaskUser* AddUser(const CString& sUser, const CString& sHosts) {
+        CHostmaskUser* pUser = new CHostmaskUser(sUser, sHosts);
+        if (!m_Users.AddUser(pUser)) {
             PutModule("That user already exists");
             return nullptr;
         }
 
-        CAutoAcceptUser* pUser = new CAutoAcceptUser(sUser, sHosts);
-        m_msUsers[sUser.AsLower()] = pUser;
         PutModule("User [" + sUser + "] added with hostmask(s) [" + sHosts + "]");
         return pUser;
     }
 
   private:
-    map<CString, CAutoAcceptUser*> m_msUsers;
+    CHostmaskUsers<CHostmaskUser> m_Users;
+    CAcceptCache m_Accepted;
+    // Nicks waiting for FlushAccepts()
+    VCString m_vsPending;
+    // Nicks recently sent in ACCEPT lines, until the server has answered
+    VCString m_vsSent;
+    // Nicks to send MESSAGE to once an ACCEPT * lists them
+    VCString m_vsTell;
+    // Our ACCEPT * is still being answered
+    bool m_bSyncing = false;
+    // ISUPPORT is known, set on the first 376 or 422
+    bool m_bReady = false;
 };
 
+CAcceptSyncTimer::CAcceptSyncTimer(CAutoAcceptMod* pMod)
+    : CTimer(pMod, SYNC_TIMEOUT, 1, "AcceptSync",
+             "Stops waiting for the server's accept list") {
+    m_pMod = pMod;
+}
+
+void CAcceptSyncTimer::RunJob() { m_pMod->SyncTimedOut(); }
+
 template <>
 void TModInfo<CAutoAcceptMod>(CModInfo& Info) {
     //    Info.SetWikiPage("AutoAccept");
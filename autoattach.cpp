@@ -15,8 +15,25 @@
  */
 
 #include <znc/Chan.h>
+#include <znc/IRCNetwork.h>
 #include <znc/Modules.h>
 
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+// What a message adds to the activity score of its channel
+#define SCORE_RULE 1.0
+#define SCORE_MENTION 2.0
+#define SCORE_HIGHLIGHT 3.0
+// Seconds until a score has halved, unless set with Activity
+#define SCORE_HALFLIFE 300
+// NV key of the activity settings, entries always contain spaces
+#define ACTIVITY_NV "activity"
+
+using std::map;
 using std::vector;
 
 class CAttachMatch {
@@ -33,18 +50,31 @@ class CAttachMatch {
         if (m_sChannelWildcard.empty()) m_sChannelWildcard = "*";
         if (m_sSearchWildcard.empty()) m_sSearchWildcard = "*";
         if (m_sHostmaskWildcard.empty()) m_sHostmaskWildcard = "*!*@*";
+
+        m_sChanLower = m_sChannelWildcard.AsLower();
+        m_sHostLower = m_sHostmaskWildcard.AsLower();
+        m_bExpand = m_sSearchWildcard.find('%') != CString::npos;
+        // These change by the second, everything else only when we are told
+        m_bVolatile = m_sSearchWildcard.find("%time%") != CString::npos ||
+                      m_sSearchWildcard.find("%uptime%") != CString::npos;
+        m_sSearchLower = m_sSearchWildcard.AsLower();
     }
 
-    bool IsMatch(const CString& sChan, const CString& sHost,
-                 const CString& sMessage) const {
-        if (!sHost.WildCmp(m_sHostmaskWildcard, CString::CaseInsensitive))
-            return false;
-        if (!sChan.WildCmp(m_sChannelWildcard, CString::CaseInsensitive))
-            return false;
-        if (!sMessage.WildCmp(m_pModule->ExpandString(m_sSearchWildcard),
-                              CString::CaseInsensitive))
-            return false;
-        return true;
+    // Arguments must be lowercase, and sChan already matched GetChans()
+    bool IsMatch(const CString& sHost, const CString& sMessage,
+                 unsigned int uExpandGen) const {
+        if (!sHost.WildCmp(m_sHostLower)) return false;
+        return sMessage.WildCmp(GetExpandedSearch(uExpandGen));
+    }
+
+    bool ChanMatches(const CString& sChan) const {
+        return sChan.WildCmp(m_sChanLower);
+    }
+
+    // The channel this entry is for, empty if it's a wildcard
+    CString GetLiteralChan() const {
+        if (m_sChanLower.find_first_of("*?") != CString::npos) return "";
+        return m_sChanLower;
     }
 
     bool IsNegated() const { return m_bNegated; }
@@ -67,11 +97,31 @@ class CAttachMatch {
     }
 
   private:
+    // The search pattern with %nick% and friends expanded, redone whenever
+    // the module says the expansion inputs might have changed
+    const CString& GetExpandedSearch(unsigned int uExpandGen) const {
+        if (!m_bExpand) return m_sSearchLower;
+
+        if (m_bVolatile || m_uExpandedGen != uExpandGen) {
+            m_sSearchLower =
+                m_pModule->ExpandString(m_sSearchWildcard).AsLower();
+            m_uExpandedGen = uExpandGen;
+        }
+        return m_sSearchLower;
+    }
+
     bool m_bNegated;
     CModule* m_pModule;
     CString m_sChannelWildcard;
     CString m_sSearchWildcard;
     CString m_sHostmaskWildcard;
+    CString m_sChanLower;
+    CString m_sHostLower;
+    bool m_bExpand;
+    bool m_bVolatile;
+    // Lowercase search pattern, expanded once m_bExpand is set
+    mutable CString m_sSearchLower;
+    mutable unsigned int m_uExpandedGen = 0;
 };
 
 class CChanAttach : public CModule {
@@ -140,6 +190,45 @@ class CChanAttach : public CModule {
         }
     }
 
+    void HandleActivity(const CString& sLine) {
+        CString sThreshold = sLine.Token(1);
+        CString sHalflife = sLine.Token(2);
+
+        if (sThreshold.Equals("off")) {
+            m_dThreshold = 0;
+            m_mActivity.clear();
+            SaveActivity();
+        } else if (!sThreshold.empty()) {
+            // Kept to the two decimals it is saved with
+            char* pEnd = nullptr;
+            double dThreshold =
+                CString(std::strtod(sThreshold.c_str(), &pEnd), 2).ToDouble();
+            unsigned int uHalflife =
+                sHalflife.empty() ? m_uHalflife : sHalflife.ToUInt();
+
+            if (*pEnd != '\0' || !(dThreshold > 0) ||
+                !std::isfinite(dThreshold) ||
+                (!sHalflife.empty() && CString(uHalflife) != sHalflife) ||
+                uHalflife == 0) {
+                PutModule(t_s("Usage: Activity [<threshold> [halflife]|off], "
+                              "both greater than 0"));
+                return;
+            }
+
+            m_dThreshold = dThreshold;
+            m_uHalflife = uHalflife;
+            SaveActivity();
+        }
+
+        if (m_dThreshold > 0) {
+            PutModule(t_f(
+                "Attaching when a channel's activity reaches {1}, halving "
+                "every {2} seconds")(CString(m_dThreshold, 2), m_uHalflife));
+        } else {
+            PutModule(t_s("Attaching on the first matching message"));
+        }
+    }
+
     void HandleSwap(const CString& sLine) {
         CString sIdx1 = sLine.Token(1);
         CString sIdx2 = sLine.Token(2);
@@ -165,6 +254,7 @@ class CChanAttach : public CModule {
         std::swap(m_vMatches[uIdx1], m_vMatches[uIdx2]);
 
         SaveMatches();
+        Reindex();
 
         PutModule(t_f("Swapped entries {1} and {2}")(sIdx1, sIdx2));
     }
@@ -184,6 +274,10 @@ class CChanAttach : public CModule {
         AddCommand("Swap", t_d("<index1> <index2>"),
                    t_d("Swap two entries by their list positions"),
                    [=](const CString& sLine) { HandleSwap(sLine); });
+        AddCommand("Activity", t_d("[<threshold> [halflife]|off]"),
+                   t_d("Attach once mentions, highlights and matches add up "
+                       "to threshold"),
+                   [=](const CString& sLine) { HandleActivity(sLine); });
     }
 
     ~CChanAttach() override {}
@@ -205,9 +299,17 @@ class CChanAttach : public CModule {
             }
         }
 
+        CString sActivity = GetNV(ACTIVITY_NV);
+        if (!sActivity.empty()) {
+            m_dThreshold = sActivity.Token(0).ToDouble();
+            m_uHalflife = std::max(1u, sActivity.Token(1).ToUInt());
+        }
+
         // Load our saved settings, ignore errors
         MCString::iterator it;
         for (it = BeginNV(); it != EndNV(); ++it) {
+            if (it->first == ACTIVITY_NV) continue;
+
             CString sAdd = it->first;
             bool bNegated = sAdd.TrimPrefix("!");
             CString sChan = sAdd.Token(0);
@@ -221,27 +323,145 @@ class CChanAttach : public CModule {
     }
 
     void TryAttach(const CNick& Nick, CChan& Channel, CString& Message) {
-        const CString& sChan = Channel.GetName();
-        const CString& sHost = Nick.GetHostMask();
-        const CString& sMessage = Message;
-        VAttachIter it;
+        CString sChan = Channel.GetName().AsLower();
 
-        if (!Channel.IsDetached()) return;
+        if (!Channel.IsDetached()) {
+            if (!m_mActivity.empty()) m_mActivity.erase(sChan);
+            return;
+        }
+
+        // Without rules for this channel only mentions could attach it,
+        // and those only count in activity mode
+        const vector<size_t>& vCandidates = GetCandidates(sChan);
+        if (vCandidates.empty() && m_dThreshold <= 0) return;
 
-        // Any negated match?
-        for (it = m_vMatches.begin(); it != m_vMatches.end(); ++it) {
-            if (it->IsNegated() && it->IsMatch(sChan, sHost, sMessage)) return;
+        CString sMessage = Message.AsLower();
+        bool bAttach = false;
+
+        // One pass: a negated match ends it, a positive one is remembered
+        if (!vCandidates.empty()) {
+            CString sHost = Nick.GetHostMask().AsLower();
+            for (size_t i : vCandidates) {
+                if (!Check(m_vMatches[i], sHost, sMessage, bAttach)) return;
+            }
         }
 
-        // Now check for a positive match
-        for (it = m_vMatches.begin(); it != m_vMatches.end(); ++it) {
-            if (!it->IsNegated() && it->IsMatch(sChan, sHost, sMessage)) {
-                Channel.AttachUser();
-                return;
+        if (m_dThreshold <= 0) {
+            if (bAttach) Channel.AttachUser();
+            return;
+        }
+
+        double dScore = ScoreMessage(sMessage) + (bAttach ? SCORE_RULE : 0);
+        if (dScore <= 0) return;
+
+        if (AddActivity(sChan, dScore) >= m_dThreshold) {
+            m_mActivity.erase(sChan);
+            Channel.AttachUser();
+        }
+    }
+
+    static bool IsNickChar(char c) {
+        return isalnum((unsigned char)c) || (c && strchr("[]\\`_^{|}-", c));
+    }
+
+    // Mentions of our nick count, being addressed by it counts more. Only
+    // whole words are mentions, "bob" isn't mentioned in "bobcat".
+    double ScoreMessage(const CString& sMessage) const {
+        CString sNick = GetNetwork()->GetCurNick().AsLower();
+        if (sNick.empty()) return 0;
+
+        for (size_t uPos = sMessage.find(sNick); uPos != CString::npos;
+             uPos = sMessage.find(sNick, uPos + 1)) {
+            size_t uEnd = uPos + sNick.length();
+            if (uPos > 0 && IsNickChar(sMessage[uPos - 1])) continue;
+            if (uEnd < sMessage.length() && IsNickChar(sMessage[uEnd]))
+                continue;
+
+            if (uPos == 0 && uEnd < sMessage.length() &&
+                (sMessage[uEnd] == ':' || sMessage[uEnd] == ',')) {
+                return SCORE_HIGHLIGHT;
+            }
+            return SCORE_MENTION;
+        }
+
+        return 0;
+    }
+
+    // Decays what the channel had so far and adds dScore to it
+    double AddActivity(const CString& sChan, double dScore) {
+        auto tNow = std::chrono::steady_clock::now();
+        SActivity& Activity = m_mActivity[sChan];
+
+        if (Activity.dScore > 0) {
+            double dElapsed =
+                std::chrono::duration<double>(tNow - Activity.tLast).count();
+            Activity.dScore *= std::exp2(-dElapsed / m_uHalflife);
+        }
+        Activity.dScore += dScore;
+        Activity.tLast = tNow;
+
+        return Activity.dScore;
+    }
+
+    // Entries that can match in sChan, worked out once per channel; an empty
+    // list means nothing can ever attach it
+    const vector<size_t>& GetCandidates(const CString& sChan) {
+        auto it = m_mChanCandidates.find(sChan);
+        if (it != m_mChanCandidates.end()) return it->second;
+
+        vector<size_t>& vCandidates = m_mChanCandidates[sChan];
+
+        auto itChan = m_mChanMatches.find(sChan);
+        if (itChan != m_mChanMatches.end()) vCandidates = itChan->second;
+
+        for (size_t i : m_vWildChanMatches) {
+            if (m_vMatches[i].ChanMatches(sChan)) vCandidates.push_back(i);
+        }
+
+        return vCandidates;
+    }
+
+    // Returns false if a negated entry matched, sets bAttach on a positive
+    bool Check(const CAttachMatch& Match, const CString& sHost,
+               const CString& sMessage, bool& bAttach) const {
+        // Once we know we attach only negated entries can change that
+        if (bAttach && !Match.IsNegated()) return true;
+        if (!Match.IsMatch(sHost, sMessage, m_uExpandGen)) return true;
+        if (Match.IsNegated()) return false;
+
+        bAttach = true;
+        return true;
+    }
+
+    // Sorts entries by channel so that a message only looks at its own
+    void Reindex() {
+        m_mChanMatches.clear();
+        m_vWildChanMatches.clear();
+        m_mChanCandidates.clear();
+
+        for (size_t i = 0; i < m_vMatches.size(); ++i) {
+            CString sChan = m_vMatches[i].GetLiteralChan();
+            if (sChan.empty()) {
+                m_vWildChanMatches.push_back(i);
+            } else {
+                m_mChanMatches[sChan].push_back(i);
             }
         }
     }
 
+    // %nick% and the like may expand differently from now on
+    void OnNick(const CNick& Nick, const CString& sNewNick,
+                const vector<CChan*>& vChans) override {
+        const CString& sCurNick = GetNetwork()->GetCurNick();
+        if (Nick.NickEquals(sCurNick) || sNewNick.Equals(sCurNick)) {
+            ++m_uExpandGen;
+        }
+    }
+
+    void OnIRCConnected() override { ++m_uExpandGen; }
+
+    void OnClientLogin() override { ++m_uExpandGen; }
+
     EModRet OnChanNoticeMessage(CNoticeMessage& Message) override {
         CString sText = Message.GetText();
         TryAttach(Message.GetNick(), *Message.GetChan(), sText);
@@ -289,6 +509,7 @@ class CChanAttach : public CModule {
         }
 
         m_vMatches.push_back(attach);
+        Reindex();
 
         // Also save it for next module load
         SetNV(attach.ToString(), "");
@@ -303,6 +524,7 @@ class CChanAttach : public CModule {
 
         DelNV(it->ToString());
         m_vMatches.erase(it);
+        Reindex();
 
         return true;
     }
@@ -313,10 +535,38 @@ class CChanAttach : public CModule {
         for (auto& match : m_vMatches) {
             SetNV(match.ToString(), "");
         }
+        SaveActivity();
+    }
+
+    void SaveActivity() {
+        if (m_dThreshold > 0) {
+            SetNV(ACTIVITY_NV,
+                  CString(m_dThreshold, 2) + " " + CString(m_uHalflife));
+        } else {
+            DelNV(ACTIVITY_NV);
+        }
     }
 
   private:
     VAttachMatch m_vMatches;
+    // Indices into m_vMatches by lowercase channel, and those for wildcards
+    map<CString, vector<size_t>> m_mChanMatches;
+    vector<size_t> m_vWildChanMatches;
+    // GetCandidates() results by lowercase channel
+    map<CString, vector<size_t>> m_mChanCandidates;
+
+    struct SActivity {
+        double dScore = 0;
+        std::chrono::steady_clock::time_point tLast;
+    };
+
+    // Activity mode is off while the threshold is 0
+    double m_dThreshold = 0;
+    unsigned int m_uHalflife = SCORE_HALFLIFE;
+    // Scores of detached channels, by lowercase name
+    map<CString, SActivity> m_mActivity;
+    // Bumped whenever expanded search patterns must be redone
+    unsigned int m_uExpandGen = 1;
 };
 
 template <>
@@ -15,78 +15,64 @@
  */
 
 #include <znc/IRCNetwork.h>
+#include <znc/IRCSock.h>
 #include <znc/Chan.h>
 
+#include <chrono>
+
+#include "hostmask.h"
+#include "tokenbucket.h"
+
 using std::map;
 using std::set;
 using std::vector;
 
+// MODE lines we may send at once, and how many per second after that
+#define VOICE_BURST 4
+#define VOICE_RATE 0.5
+// Leaves room for the prefix the server adds when relaying our MODE
+#define MODE_LINE_LEN 400
+// Seconds joins are collected before voicing, unless set in the arguments
+#define VOICE_DELAY 2
+
 class CAutoVoiceMod;
 
-class CAutoVoiceUser {
+class CAutoVoiceTimer : public CTimer {
   public:
-    CAutoVoiceUser() {}
+    CAutoVoiceTimer(CAutoVoiceMod* pMod);
+    ~CAutoVoiceTimer() override {}
+
+    void RunJob() override;
+
+  private:
+    CAutoVoiceMod* m_pMod;
+};
 
-    CAutoVoiceUser(const CString& sLine) { FromString(sLine); }
+class CAutoVoiceUser : public CHostmaskUser {
+  public:
+    CAutoVoiceUser() {}
 
     CAutoVoiceUser(const CString& sUsername, const CString& sHostmasks,
                    const CString& sChannels)
-        : m_sUsername(sUsername) {
-        AddHostmasks(sHostmasks);
+        : CHostmaskUser(sUsername, sHostmasks) {
         AddChans(sChannels);
     }
 
-    virtual ~CAutoVoiceUser() {}
-
-    const CString& GetUsername() const { return m_sUsername; }
-
+    // sChan must already be lowercase
     bool ChannelMatches(const CString& sChan) const {
-        for (const CString& s : m_ssChans) {
-            if (sChan.AsLower().WildCmp(s, CString::CaseInsensitive)) {
-                return true;
-            }
-        }
-
-        return false;
-    }
+        if (m_ssChans.count(sChan)) return true;
 
-    bool HostMatches(const CString& sHostmask) {
-        for (const CString& s : m_ssHostmasks) {
-            if (sHostmask.WildCmp(s, CString::CaseInsensitive)) {
-                return true;
-            }
+        for (const CString& s : m_vsWildChans) {
+            if (sChan.WildCmp(s)) return true;
         }
-        return false;
-    }
 
-    CString GetHostmasks() const {
-        return CString(",").Join(m_ssHostmasks.begin(), m_ssHostmasks.end());
+        return false;
     }
 
     CString GetChannels() const {
         return CString(" ").Join(m_ssChans.begin(), m_ssChans.end());
     }
 
-    bool DelHostmasks(const CString& sHostmasks) {
-        VCString vsHostmasks;
-        sHostmasks.Split(",", vsHostmasks);
-
-        for (const CString& s : vsHostmasks) {
-            m_ssHostmasks.erase(s);
-        }
-
-        return m_ssHostmasks.empty();
-    }
-
-    void AddHostmasks(const CString& sHostmasks) {
-        VCString vsHostmasks;
-        sHostmasks.Split(",", vsHostmasks);
-
-        for (const CString& s : vsHostmasks) {
-            m_ssHostmasks.insert(s);
-        }
-    }
-
     void DelChans(const CString& sChans) {
         VCString vsChans;
         sChans.Split(" ", vsChans);
@@ -94,6 +80,7 @@ class CAutoVoiceUser {
         for (const CString& sChan : vsChans) {
             m_ssChans.erase(sChan.AsLower());
         }
+        CompileChans();
     }
 
     void AddChans(const CString& sChans) {
@@ -103,25 +90,33 @@ class CAutoVoiceUser {
         for (const CString& sChan : vsChans) {
             m_ssChans.insert(sChan.AsLower());
         }
+        CompileChans();
+    }
+
+    // Patterns without wildcards are found in m_ssChans directly
+    void CompileChans() {
+        m_vsWildChans.clear();
+        for (const CString& s : m_ssChans) {
+            if (s.find_first_of("*?") != CString::npos) {
+                m_vsWildChans.push_back(s);
+            }
+        }
     }
 
-    CString ToString() const {
-        return m_sUsername + "\t" + GetHostmasks() + "\t" + GetChannels();
+    CString ToString() const override {
+        return CHostmaskUser::ToString() + "\t" + GetChannels();
     }
 
-    bool FromString(const CString& sLine) {
-        m_sUsername = sLine.Token(0, false, "\t");
-        sLine.Token(1, false, "\t").Split(",", m_ssHostmasks);
+    bool FromString(const CString& sLine) override {
+        if (!CHostmaskUser::FromString(sLine)) return false;
         sLine.Token(2, false, "\t").Split(" ", m_ssChans);
+        CompileChans();
         return true;
-
     }
 
   private:
-  protected:
-    CString m_sUsername;
-    set<CString> m_ssHostmasks;
     set<CString> m_ssChans;
+    vector<CString> m_vsWildChans;
 };
 
 class CAutoVoiceMod : public CModule {
@@ -148,50 +143,75 @@ class CAutoVoiceMod : public CModule {
                    [=](const CString& sLine) { OnAddUserCommand(sLine); });
         AddCommand("DelUser", t_d("<user>"), t_d("Removes a user"),
                    [=](const CString& sLine) { OnDelUserCommand(sLine); });
+        AddCommand("Delay", t_d("[seconds]"),
+                   t_d("Show or set how long joins are collected before "
+                       "voicing"),
+                   [=](const CString& sLine) { OnDelayCommand(sLine); });
     }
 
     bool OnLoad(const CString& sArgs, CString& sMessage) override {
-
-        // Load the users
-        for (MCString::iterator it = BeginNV(); it != EndNV(); ++it) {
-            const CString& sLine = it->second;
-            CAutoVoiceUser* pUser = new CAutoVoiceUser;
-
-            if (!pUser->FromString(sLine) ||
-                FindUser(pUser->GetUsername().AsLower())) {
-                delete pUser;
-            } else {
-                m_msUsers[pUser->GetUsername().AsLower()] = pUser;
+        CString sDelay = sArgs.Trim_n();
+        if (!sDelay.empty()) {
+            if (CString(sDelay.ToUInt()) != sDelay) {
+                sMessage = t_s("Argument must be the join delay in seconds");
+                return false;
             }
+            m_uDelay = sDelay.ToUInt();
         }
 
-        return true;
-    }
+        m_Users.Load(this);
 
-    ~CAutoVoiceMod() override {
-        for (const auto& it : m_msUsers) {
-            delete it.second;
-        }
-        m_msUsers.clear();
+        return true;
     }
 
     void OnJoin(const CNick& Nick, CChan& Channel) override {
         // If we have ops in this chan
         if (Channel.HasPerm(CChan::Op) || Channel.HasPerm(CChan::HalfOp)) {
-            CheckAutoVoice(Nick, Channel);
+            if (CheckAutoVoice(Nick, Channel, m_uDelay)) DrainVoices();
         }
     }
 
+    void OnNick(const CNick& Nick, const CString& sNewNick,
+                const vector<CChan*>& vChans) override {
+        for (CChan* pChan : vChans) {
+            auto it = m_mPending.find(pChan->GetName());
+            if (it == m_mPending.end()) continue;
+
+            if (it->second.ssNicks.erase(Nick.GetNick())) {
+                it->second.ssNicks.insert(sNewNick);
+            }
+        }
+    }
+
+    void OnIRCDisconnected() override {
+        m_mPending.clear();
+        StopTimer();
+    }
+
     void OnOp2(const CNick* pVoiceNick, const CNick& Nick, CChan& Channel,
                bool bNoChange) override {
         if (Nick.GetNick() == GetNetwork()->GetIRCNick().GetNick()) {
             const map<CString, CNick>& msNicks = Channel.GetNicks();
+            VCString vsNicks, vsHostmasks;
 
             for (const auto& it : msNicks) {
                 if (!it.second.HasPerm(CChan::Voice)) {
-                    CheckAutoVoice(it.second, Channel);
+                    vsNicks.push_back(it.second.GetNick());
+                    vsHostmasks.push_back(it.second.GetHostMask());
                 }
             }
+
+            CString sChan = Channel.GetName().AsLower();
+            vector<CAutoVoiceUser*> vpUsers = m_Users.FindEach(
+                vsHostmasks, [&](CAutoVoiceUser* pUser) {
+                    return pUser->ChannelMatches(sChan);
+                });
+
+            for (size_t i = 0; i < vpUsers.size(); ++i) {
+                if (vpUsers[i]) QueueVoice(vsNicks[i], Channel);
+            }
+
+            DrainVoices();
         }
     }
 
@@ -208,7 +228,7 @@ class CAutoVoiceMod : public CModule {
                 AddUser(sUser, sHost, sLine.Token(3, true));
 
             if (pUser) {
-                SetNV(sUser, pUser->ToString());
+                m_Users.Save(this, pUser);
             }
         }
     }
@@ -225,7 +245,7 @@ class CAutoVoiceMod : public CModule {
     }
 
     void OnListUsersCommand(const CString& sLine) {
-        if (m_msUsers.empty()) {
+        if (m_Users.empty()) {
             PutModule(t_s("There are no users defined"));
             return;
         }
@@ -236,7 +256,7 @@ class CAutoVoiceMod : public CModule {
         Table.AddColumn(t_s("Hostmasks"));
         Table.AddColumn(t_s("Channels"));
 
-        for (const auto& it : m_msUsers) {
+        for (const auto& it : m_Users.GetUsers()) {
             VCString vsHostmasks;
             it.second->GetHostmasks().Split(",", vsHostmasks);
             for (unsigned int a = 0; a < vsHostmasks.size(); a++) {
@@ -274,7 +294,7 @@ class CAutoVoiceMod : public CModule {
 
         pUser->AddChans(sChans);
         PutModule(t_f("Channel(s) added to user {1}")(pUser->GetUsername()));
-        SetNV(pUser->GetUsername(), pUser->ToString());
+        m_Users.Save(this, pUser);
     }
 
     void OnDelChansCommand(const CString& sLine) {
@@ -296,7 +316,7 @@ class CAutoVoiceMod : public CModule {
         pUser->DelChans(sChans);
         PutModule(
             t_f("Channel(s) Removed from user {1}")(pUser->GetUsername()));
-        SetNV(pUser->GetUsername(), pUser->ToString());
+        m_Users.Save(this, pUser);
     }
 
     void OnAddMasksCommand(const CString& sLine) {
@@ -316,8 +336,9 @@ class CAutoVoiceMod : public CModule {
         }
 
         pUser->AddHostmasks(sHostmasks);
+        m_Users.Reindex();
         PutModule(t_f("Hostmasks(s) added to user {1}")(pUser->GetUsername()));
-        SetNV(pUser->GetUsername(), pUser->ToString());
+        m_Users.Save(this, pUser);
     }
 
     void OnDelMasksCommand(const CString& sLine) {
@@ -337,84 +358,209 @@ class CAutoVoiceMod : public CModule {
         }
 
         if (pUser->DelHostmasks(sHostmasks)) {
-            PutModule(t_f("Removed user {1} with channels {3}")(
+            PutModule(t_f("Removed user {1} with channels {2}")(
                 pUser->GetUsername(),
                 pUser->GetChannels()));
             DelUser(sUser);
             DelNV(sUser);
         } else {
+            m_Users.Reindex();
             PutModule(t_f("Hostmasks(s) Removed from user {1}")(
                 pUser->GetUsername()));
-            SetNV(pUser->GetUsername(), pUser->ToString());
+            m_Users.Save(this, pUser);
         }
     }
 
     CAutoVoiceUser* FindUser(const CString& sUser) {
-        map<CString, CAutoVoiceUser*>::iterator it =
-            m_msUsers.find(sUser.AsLower());
-
-        return (it != m_msUsers.end()) ? it->second : nullptr;
+        return m_Users.FindUser(sUser);
     }
 
     CAutoVoiceUser* FindUserByHost(const CString& sHostmask,
                                    const CString& sChannel = "") {
-        for (const auto& it : m_msUsers) {
-            CAutoVoiceUser* pUser = it.second;
+        CString sChan = sChannel.AsLower();
+
+        return m_Users.Find(sHostmask, [&](CAutoVoiceUser* pUser) {
+            return sChan.empty() || pUser->ChannelMatches(sChan);
+        });
+    }
+
+    void OnDelayCommand(const CString& sLine) {
+        CString sDelay = sLine.Token(1);
 
-            if (pUser->HostMatches(sHostmask) &&
-                (sChannel.empty() || pUser->ChannelMatches(sChannel))) {
-                return pUser;
+        if (!sDelay.empty()) {
+            if (CString(sDelay.ToUInt()) != sDelay) {
+                PutModule(t_s("Usage: Delay [seconds]"));
+                return;
             }
+            m_uDelay = sDelay.ToUInt();
+            SetArgs(CString(m_uDelay));
         }
 
-        return nullptr;
+        PutModule(t_f("Joins are voiced after {1} seconds")(m_uDelay));
     }
 
-    bool CheckAutoVoice(const CNick& Nick, CChan& Channel) {
+    bool CheckAutoVoice(const CNick& Nick, CChan& Channel,
+                        unsigned int uDelay = 0) {
         CAutoVoiceUser* pUser =
             FindUserByHost(Nick.GetHostMask(), Channel.GetName());
         if (!pUser) {
             return false;
         }
 
-        PutIRC("MODE " + Channel.GetName() + " +v " + Nick.GetNick());
+        QueueVoice(Nick.GetNick(), Channel, uDelay);
         return true;
     }
 
-    void DelUser(const CString& sUser) {
-        map<CString, CAutoVoiceUser*>::iterator it =
-            m_msUsers.find(sUser.AsLower());
+    void QueueVoice(const CString& sNick, CChan& Channel,
+                    unsigned int uDelay = 0) {
+        SPendingVoices& Pending = m_mPending[Channel.GetName()];
+        if (Pending.ssNicks.empty()) {
+            Pending.tDue = std::chrono::steady_clock::now() +
+                           std::chrono::seconds(uDelay);
+        }
+        Pending.ssNicks.insert(sNick);
+    }
+
+    // How many modes the server takes in one MODE line
+    unsigned int GetMaxModes() {
+        CIRCSock* pIRCSock = GetNetwork()->GetIRCSock();
+        if (!pIRCSock) return 1;
+
+        // MODES without a value means no limit, no MODES at all means 3
+        CString sModes = pIRCSock->GetISupport("MODES", "3");
+        if (sModes.empty()) return MODE_LINE_LEN;
+        return std::max(1u, sModes.ToUInt());
+    }
+
+    // Packs as many of the nicks as fit into one MODE +vvv... line
+    CString TakeModeLine(const CString& sChan, set<CString>& ssNicks,
+                         unsigned int uMaxModes) {
+        CString sModes = "+";
+        CString sNicks;
+        size_t uLen = CString("MODE  +").size() + sChan.size();
+
+        auto it = ssNicks.begin();
+        while (it != ssNicks.end() && sModes.size() <= uMaxModes) {
+            // The first nick always goes, even if the line gets long
+            uLen += 2 + it->size();
+            if (sNicks.size() && uLen > MODE_LINE_LEN) break;
+
+            sModes += "v";
+            sNicks += " " + *it;
+            it = ssNicks.erase(it);
+        }
+
+        return "MODE " + sChan + " " + sModes + sNicks;
+    }
 
-        if (it == m_msUsers.end()) {
+    // Sends pending voices, packed per channel and paced so that a big
+    // channel doesn't get us killed for flooding
+    void DrainVoices() {
+        auto tNow = std::chrono::steady_clock::now();
+        unsigned int uMaxModes = GetMaxModes();
+
+        for (auto it = m_mPending.begin();
+             it != m_mPending.end() && m_Bucket.Ready();) {
+            CChan* pChan = GetNetwork()->FindChan(it->first);
+            set<CString>& ssNicks = it->second.ssNicks;
+
+            // We left or lost ops in the meantime
+            if (!pChan || !(pChan->HasPerm(CChan::Op) ||
+                            pChan->HasPerm(CChan::HalfOp))) {
+                it = m_mPending.erase(it);
+                continue;
+            }
+
+            // Still collecting joins
+            if (tNow < it->second.tDue) {
+                ++it;
+                continue;
+            }
+
+            // Someone else voiced them, or they are gone already
+            for (auto itNick = ssNicks.begin(); itNick != ssNicks.end();) {
+                const CNick* pNick = pChan->FindNick(*itNick);
+                if (!pNick || pNick->HasPerm(CChan::Voice)) {
+                    itNick = ssNicks.erase(itNick);
+                } else {
+                    ++itNick;
+                }
+            }
+
+            while (!ssNicks.empty() && m_Bucket.TryTake()) {
+                PutIRC(TakeModeLine(pChan->GetName(), ssNicks, uMaxModes));
+            }
+
+            if (ssNicks.empty()) {
+                it = m_mPending.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        if (m_mPending.empty()) {
+            StopTimer();
+        } else if (!m_pTimer) {
+            m_pTimer = new CAutoVoiceTimer(this);
+            AddTimer(m_pTimer);
+        }
+    }
+
+    void StopTimer() {
+        if (!m_pTimer) return;
+
+        m_pTimer->Stop();
+        m_pTimer = nullptr;
+    }
+
+    void DelUser(const CString& sUser) {
+        if (!m_Users.DelUser(sUser)) {
             PutModule(t_s("No such user"));
             return;
         }
 
-        delete it->second;
-        m_msUsers.erase(it);
         PutModule(t_f("User {1} removed")(sUser));
     }
 
     CAutoVoiceUser* AddUser(const CString& sUser, const CString& sHosts,
                             const CString& sChans) {
-        if (m_msUsers.find(sUser) != m_msUsers.end()) {
+        CAutoVoiceUser* pUser = new CAutoVoiceUser(sUser, sHosts, sChans);
+        if (!m_Users.AddUser(pUser)) {
             PutModule(t_s("That user already exists"));
             return nullptr;
         }
 
-        CAutoVoiceUser* pUser = new CAutoVoiceUser(sUser, sHosts, sChans);
-        m_msUsers[sUser.AsLower()] = pUser;
         PutModule(t_f("User {1} added with hostmask(s) {2}")(sUser, sHosts));
         return pUser;
     }
 
   private:
-    map<CString, CAutoVoiceUser*> m_msUsers;
+    CHostmaskUsers<CAutoVoiceUser> m_Users;
+    struct SPendingVoices {
+        set<CString> ssNicks;
+        std::chrono::steady_clock::time_point tDue;
+    };
+
+    // Nicks waiting for +v, by channel
+    map<CString, SPendingVoices> m_mPending;
+    unsigned int m_uDelay = VOICE_DELAY;
+    CAutoVoiceTimer* m_pTimer = nullptr;
+    CTokenBucket m_Bucket{VOICE_BURST, VOICE_RATE};
 };
 
+CAutoVoiceTimer::CAutoVoiceTimer(CAutoVoiceMod* pMod)
+    : CTimer(pMod, 1, 0, "AutoVoiceTimer", "Sends queued voices") {
+    m_pMod = pMod;
+}
+
+void CAutoVoiceTimer::RunJob() { m_pMod->DrainVoices(); }
+
 template <>
 void TModInfo<CAutoVoiceMod>(CModInfo& Info) {
     Info.SetWikiPage("autovoice");
+    Info.SetHasArgs(true);
+    Info.SetArgsHelpText(Info.t_s(
+        "Seconds to collect joins before voicing them, default 2."));
 }
 
 NETWORKMODULEDEFS(CAutoVoiceMod, t_s("Auto voice the good people"))
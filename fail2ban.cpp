@@ -15,9 +15,414 @@
  */
 
 #include <znc/znc.h>
+#include <znc/FileUtils.h>
 #include <znc/User.h>
 
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <functional>
+#include <list>
+#include <memory>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+
+#include "tokenbucket.h"
+
+// An IPv4 or IPv6 address with a prefix length. IPv4 addresses are kept as
+// IPv4-mapped IPv6 addresses (::ffff:a.b.c.d) so that both families share
+// one 128 bit key space.
+class CIPPrefix {
+  public:
+    CIPPrefix() { m_Addr.fill(0); }
+
+    // Accepts "addr" and "addr/len". Without a length the prefix covers a
+    // single address.
+    static bool Parse(const CString& sText, CIPPrefix& Prefix) {
+        CString sAddr = sText.Token(0, false, "/");
+        CString sLen = sText.Token(1, false, "/");
+        bool bV4 = sAddr.find(':') == CString::npos;
+
+        Prefix = CIPPrefix();
+        if (bV4) {
+            Prefix.m_Addr[10] = 0xff;
+            Prefix.m_Addr[11] = 0xff;
+            if (inet_pton(AF_INET, sAddr.c_str(), &Prefix.m_Addr[12]) != 1)
+                return false;
+        } else {
+            if (inet_pton(AF_INET6, sAddr.c_str(), Prefix.m_Addr.data()) != 1)
+                return false;
+        }
+
+        Prefix.m_uLen = 128;
+        if (!sText.Token(2, false, "/").empty()) return false;
+        if (!sLen.empty()) {
+            unsigned int uLen = sLen.ToUInt();
+            if (CString(uLen) != sLen || uLen > (bV4 ? 32u : 128u))
+                return false;
+            Prefix.m_uLen = bV4 ? 96 + uLen : uLen;
+        }
+
+        Prefix = Prefix.Masked(Prefix.m_uLen);
+        return true;
+    }
+
+    bool IsV4() const {
+        static const unsigned char aMapped[12] = {0, 0, 0, 0, 0,    0,
+                                                  0, 0, 0, 0, 0xff, 0xff};
+        return m_uLen >= 96 &&
+               std::equal(aMapped, aMapped + 12, m_Addr.begin());
+    }
+
+    CString ToString() const {
+        char szBuf[INET6_ADDRSTRLEN];
+        if (IsV4()) {
+            inet_ntop(AF_INET, &m_Addr[12], szBuf, sizeof(szBuf));
+            if (m_uLen == 128) return szBuf;
+            return CString(szBuf) + "/" + CString(m_uLen - 96);
+        }
+
+        inet_ntop(AF_INET6, m_Addr.data(), szBuf, sizeof(szBuf));
+        if (m_uLen == 128) return szBuf;
+        return CString(szBuf) + "/" + CString(m_uLen);
+    }
+
+    unsigned int GetLen() const { return m_uLen; }
+
+    unsigned int Bit(unsigned int i) const {
+        return (m_Addr[i / 8] >> (7 - i % 8)) & 1;
+    }
+
+    CIPPrefix Masked(unsigned int uLen) const {
+        CIPPrefix Prefix = *this;
+        Prefix.m_uLen = uLen;
+        for (unsigned int i = 0; i < 16; i++) {
+            if (uLen >= (i + 1) * 8) continue;
+            if (uLen <= i * 8) {
+                Prefix.m_Addr[i] = 0;
+            } else {
+                Prefix.m_Addr[i] &= 0xff << (8 - uLen % 8);
+            }
+        }
+        return Prefix;
+    }
+
+    // Number of leading bits both prefixes have in common
+    unsigned int CommonLen(const CIPPrefix& Other) const {
+        unsigned int uMax = std::min(m_uLen, Other.m_uLen);
+        unsigned int uLen = 0;
+        for (unsigned int i = 0; i < 16 && uLen < uMax; i++) {
+            unsigned char uDiff = m_Addr[i] ^ Other.m_Addr[i];
+            if (uDiff == 0) {
+                uLen += 8;
+                continue;
+            }
+            while (!(uDiff & 0x80)) {
+                uDiff <<= 1;
+                uLen++;
+            }
+            break;
+        }
+        return std::min(uLen, uMax);
+    }
+
+    bool Covers(const CIPPrefix& Other) const {
+        return m_uLen <= Other.m_uLen && CommonLen(Other) >= m_uLen;
+    }
+
+    bool operator==(const CIPPrefix& Other) const {
+        return m_uLen == Other.m_uLen && m_Addr == Other.m_Addr;
+    }
+
+  private:
+    std::array<unsigned char, 16> m_Addr;
+    unsigned int m_uLen = 0;
+};
+
+// Path-compressed binary radix trie keyed by CIPPrefix. Every lookup walks at
+// most one node per address bit.
+template <typename T>
+class CPrefixTrie {
+  public:
+    T* Find(const CIPPrefix& Prefix) const {
+        Node* pNode = m_pRoot.get();
+        while (pNode && pNode->Prefix.Covers(Prefix)) {
+            if (pNode->Prefix.GetLen() == Prefix.GetLen())
+                return pNode->pValue.get();
+            pNode = pNode->apChild[Prefix.Bit(pNode->Prefix.GetLen())].get();
+        }
+        return nullptr;
+    }
+
+    T& Insert(const CIPPrefix& Prefix) {
+        std::unique_ptr<Node>* ppNode = &m_pRoot;
+
+        while (true) {
+            if (!*ppNode) {
+                ppNode->reset(new Node(Prefix));
+                return *NewValue(ppNode->get());
+            }
+
+            Node* pNode = ppNode->get();
+            unsigned int uCommon = pNode->Prefix.CommonLen(Prefix);
+
+            if (uCommon == pNode->Prefix.GetLen()) {
+                if (uCommon == Prefix.GetLen()) {
+                    if (!pNode->pValue) NewValue(pNode);
+                    return *pNode->pValue;
+                }
+                ppNode = &pNode->apChild[Prefix.Bit(uCommon)];
+                continue;
+            }
+
+            // The new prefix branches off above this node
+            std::unique_ptr<Node> pOld = std::move(*ppNode);
+            if (uCommon == Prefix.GetLen()) {
+                ppNode->reset(new Node(Prefix));
+                (*ppNode)->apChild[pOld->Prefix.Bit(uCommon)] = std::move(pOld);
+                return *NewValue(ppNode->get());
+            }
+
+            ppNode->reset(new Node(Prefix.Masked(uCommon)));
+            Node* pLeaf = new Node(Prefix);
+            (*ppNode)->apChild[pOld->Prefix.Bit(uCommon)] = std::move(pOld);
+            (*ppNode)->apChild[Prefix.Bit(uCommon)].reset(pLeaf);
+            return *NewValue(pLeaf);
+        }
+    }
+
+    bool Remove(const CIPPrefix& Prefix) {
+        std::vector<std::unique_ptr<Node>*> vpPath;
+        std::unique_ptr<Node>* ppNode = &m_pRoot;
+
+        while (*ppNode && (*ppNode)->Prefix.Covers(Prefix)) {
+            vpPath.push_back(ppNode);
+            if ((*ppNode)->Prefix.GetLen() == Prefix.GetLen()) break;
+            ppNode = &(*ppNode)->apChild[Prefix.Bit((*ppNode)->Prefix.GetLen())];
+        }
+
+        if (vpPath.empty()) return false;
+        Node* pNode = vpPath.back()->get();
+        if (pNode->Prefix.GetLen() != Prefix.GetLen() || !pNode->pValue)
+            return false;
+
+        pNode->pValue.reset();
+        m_uSize--;
+
+        // Drop nodes that no longer carry a value or a branch
+        while (!vpPath.empty()) {
+            std::unique_ptr<Node>& pCur = *vpPath.back();
+            vpPath.pop_back();
+            if (pCur->pValue) break;
+            if (pCur->apChild[0] && pCur->apChild[1]) break;
+
+            std::unique_ptr<Node> pChild = std::move(
+                pCur->apChild[0] ? pCur->apChild[0] : pCur->apChild[1]);
+            pCur = std::move(pChild);
+            if (pCur) break;
+        }
+
+        return true;
+    }
+
+    // Calls fn for every stored prefix covering Prefix, shortest first
+    void ForEachMatch(const CIPPrefix& Prefix,
+                      const std::function<void(const CIPPrefix&, T&)>& fn) {
+        Node* pNode = m_pRoot.get();
+        while (pNode && pNode->Prefix.Covers(Prefix)) {
+            if (pNode->pValue) fn(pNode->Prefix, *pNode->pValue);
+            if (pNode->Prefix.GetLen() == Prefix.GetLen()) break;
+            pNode = pNode->apChild[Prefix.Bit(pNode->Prefix.GetLen())].get();
+        }
+    }
+
+    void ForEach(const std::function<void(const CIPPrefix&, T&)>& fn) {
+        ForEach(m_pRoot.get(), fn);
+    }
+
+    void Clear() {
+        m_pRoot.reset();
+        m_uSize = 0;
+    }
+
+    size_t size() const { return m_uSize; }
+    bool empty() const { return m_uSize == 0; }
+
+  private:
+    struct Node {
+        explicit Node(const CIPPrefix& NodePrefix) : Prefix(NodePrefix) {}
+
+        CIPPrefix Prefix;
+        std::unique_ptr<Node> apChild[2];
+        std::unique_ptr<T> pValue;
+    };
+
+    T* NewValue(Node* pNode) {
+        pNode->pValue.reset(new T());
+        m_uSize++;
+        return pNode->pValue.get();
+    }
+
+    void ForEach(Node* pNode,
+                 const std::function<void(const CIPPrefix&, T&)>& fn) {
+        if (!pNode) return;
+        if (pNode->pValue) fn(pNode->Prefix, *pNode->pValue);
+        ForEach(pNode->apChild[0].get(), fn);
+        ForEach(pNode->apChild[1].get(), fn);
+    }
+
+    std::unique_ptr<Node> m_pRoot;
+    size_t m_uSize = 0;
+};
+
+// Event counts over the last Slots * Width seconds, kept in a fixed ring of
+// buckets that are cleared as time moves past them
+class CRollingWindow {
+  public:
+    CRollingWindow(unsigned int uSlots, unsigned int uWidth)
+        : m_vuBuckets(uSlots, 0), m_uWidth(uWidth) {}
+
+    void Add(time_t now, unsigned long long uCount = 1) {
+        Advance(now);
+        m_vuBuckets[(now / m_uWidth) % m_vuBuckets.size()] += uCount;
+    }
+
+    unsigned long long Sum(time_t now) {
+        Advance(now);
+        unsigned long long uSum = 0;
+        for (unsigned long long u : m_vuBuckets) uSum += u;
+        return uSum;
+    }
+
+  private:
+    void Advance(time_t now) {
+        time_t tBucket = now / m_uWidth;
+        if (tBucket <= m_tBucket) return;
+
+        time_t tClear = std::min<time_t>(tBucket - m_tBucket,
+                                         m_vuBuckets.size());
+        for (time_t t = tBucket - tClear + 1; t <= tBucket; t++)
+            m_vuBuckets[t % m_vuBuckets.size()] = 0;
+        m_tBucket = tBucket;
+    }
+
+    std::vector<unsigned long long> m_vuBuckets;
+    unsigned int m_uWidth;
+    time_t m_tBucket = 0;
+};
+
+// Approximate top-k of a stream using the Space-Saving algorithm. At most
+// Capacity keys are tracked, a new key replaces the least frequent one and
+// inherits its count.
+class CTopCounter {
+  public:
+    explicit CTopCounter(size_t uCapacity) : m_uCapacity(uCapacity) {}
+
+    void Add(const CString& sKey) {
+        auto it = m_mCounts.find(sKey);
+        if (it != m_mCounts.end()) {
+            it->second++;
+            return;
+        }
+
+        if (m_mCounts.size() < m_uCapacity) {
+            m_mCounts[sKey] = 1;
+            return;
+        }
+
+        auto itMin = std::min_element(
+            m_mCounts.begin(), m_mCounts.end(),
+            [](const std::pair<const std::string, unsigned long long>& a,
+               const std::pair<const std::string, unsigned long long>& b) {
+                return a.second < b.second;
+            });
+        unsigned long long uCount = itMin->second + 1;
+        m_mCounts.erase(itMin);
+        m_mCounts[sKey] = uCount;
+    }
+
+    std::vector<std::pair<CString, unsigned long long>> Top(size_t uMax) const {
+        std::vector<std::pair<CString, unsigned long long>> vTop(
+            m_mCounts.begin(), m_mCounts.end());
+        std::sort(vTop.begin(), vTop.end(),
+                  [](const std::pair<CString, unsigned long long>& a,
+                     const std::pair<CString, unsigned long long>& b) {
+                      return a.second > b.second;
+                  });
+        if (vTop.size() > uMax) vTop.resize(uMax);
+        return vTop;
+    }
+
+  private:
+    std::unordered_map<std::string, unsigned long long> m_mCounts;
+    size_t m_uCapacity;
+};
+
+class CFailToBanMod;
+
+class CFailToBanTimer : public CTimer {
+  public:
+    CFailToBanTimer(CFailToBanMod* pMod);
+    ~CFailToBanTimer() override {}
+
+    void RunJob() override;
+
+  private:
+    CFailToBanMod* m_pMod;
+};
+
 class CFailToBanMod : public CModule {
+    struct BanInfo {
+        unsigned int id = 0;
+        unsigned int attempts = 0;
+        time_t first_attempt = 0;
+        time_t last_attempt = 0;
+        CString username;
+        time_t expires = 0;
+        // Second of the expiry wheel slot the entry is queued in, 0 if none
+        time_t wheel_at = 0;
+        // Position in the eviction order: fewest attempts, then oldest
+        std::tuple<unsigned int, time_t, unsigned int> evict_key;
+        // How long a refresh keeps the entry, grows with every re-ban
+        time_t duration = 0;
+    };
+
+    // Ban history of a prefix, kept after its entry has expired
+    struct Offender {
+        unsigned int bans;
+        time_t last_ban;
+    };
+
+    // Rate of one kind of event over the last minute and hour
+    struct Counter {
+        Counter() : minute(60, 1), hour(60, 60) {}
+
+        void Add(time_t now) {
+            minute.Add(now);
+            hour.Add(now);
+            total++;
+        }
+
+        CRollingWindow minute;
+        CRollingWindow hour;
+        unsigned long long total = 0;
+    };
+
+    static const unsigned int HISTORY_SIZE = 4096;
+    static const time_t HISTORY_FORGET = 7 * 24 * 60 * 60;
+
+    static const unsigned int WHEEL_SLOTS = 256;
+
+    // Limits how often a prefix may open connections
+    struct ConnBucket {
+        CTokenBucket tokens;
+        // Whether the current run of refusals has been logged
+        bool logged;
+    };
+
   public:
     MODCONSTRUCTOR(CFailToBanMod) {
         AddHelpCommand();
@@ -35,8 +440,32 @@ class CFailToBanMod : public CModule {
                    [=](const CString& sLine) { OnUnbanCommand(sLine); });
         AddCommand("List", "", t_d("List banned hosts."),
                    [=](const CString& sLine) { OnListCommand(sLine); });
+        AddCommand("Stats", "",
+                   t_d("Show failed logins, refused connections and bans "
+                       "over the last minute and hour."),
+                   [=](const CString& sLine) { OnStatsCommand(sLine); });
+        AddCommand("ConnectLimit", t_d("[burst] [per minute]"),
+                   t_d("How many connections a prefix may open at once and "
+                       "per minute after that. A burst of 0 disables it."),
+                   [=](const CString& sLine) { OnConnectLimitCommand(sLine); });
+        AddCommand("Escalate", t_d("[factor] [max minutes]"),
+                   t_d("Multiply the timeout by factor for every repeated "
+                       "ban, up to max minutes. A factor of 1 disables it."),
+                   [=](const CString& sLine) { OnEscalateCommand(sLine); });
+        AddCommand("MaxEntries", t_d("[count]"),
+                   t_d("The number of hosts tracked before the ones with the "
+                       "fewest attempts are evicted."),
+                   [=](const CString& sLine) { OnMaxEntriesCommand(sLine); });
+        AddCommand("Prefix", t_d("[IPv4 bits] [IPv6 bits]"),
+                   t_d("The prefix lengths failed logins are counted per."),
+                   [=](const CString& sLine) { OnPrefixCommand(sLine); });
+    }
+    ~CFailToBanMod() override {
+        // A failed OnLoad never read the files, don't overwrite them
+        if (!m_bLoaded) return;
+        FlushJournal();
+        SaveOffenders();
     }
-    ~CFailToBanMod() override {}
 
     bool OnLoad(const CString& sArgs, CString& sMessage) override {
         CString sTimeout = sArgs.Token(0);
@@ -59,30 +488,454 @@ class CFailToBanMod : public CModule {
             return false;
         }
 
-        // SetTTL() wants milliseconds
-        m_Cache.SetTTL(timeout * 60 * 1000);
+        m_uTTL = timeout * 60;
+
+        m_uV4Prefix = HasNV("ipv4_prefix") ? GetNV("ipv4_prefix").ToUInt() : 32;
+        m_uV6Prefix = HasNV("ipv6_prefix") ? GetNV("ipv6_prefix").ToUInt() : 64;
+
+        m_uConnBurst =
+            HasNV("connect_burst") ? GetNV("connect_burst").ToUInt() : 0;
+        m_uConnPerMin =
+            HasNV("connect_rate") ? GetNV("connect_rate").ToUInt() : 20;
+
+        m_uMaxEntries =
+            HasNV("max_entries") ? GetNV("max_entries").ToUInt() : 10000;
+        m_dEscalate = HasNV("escalate_factor")
+                          ? GetNV("escalate_factor").ToDouble()
+                          : 2;
+        m_uEscalateMax =
+            HasNV("escalate_max") ? GetNV("escalate_max").ToUInt() : 1440;
+
+        m_vWheel.resize(WHEEL_SLOTS);
+        m_tWheelTime = time(nullptr);
+
+        m_uNextId = std::max(1u, GetNV("next_id").ToUInt());
+        LoadBans();
+        AddTimer(new CFailToBanTimer(this));
+        m_bLoaded = true;
 
         return true;
     }
 
-    void OnPostRehash() override { m_Cache.Clear(); }
+    bool IsExpired(const BanInfo& Info, time_t now) const {
+        return now >= Info.expires;
+    }
+
+    // Bans are kept on disk as a snapshot plus an append-only journal of
+    // changes since. The journal is buffered and flushed by a timer, and
+    // folded back into the snapshot once it grows larger than the table.
+    CString BansFile() const { return GetSavePath() + "/bans"; }
+    CString JournalFile() const { return GetSavePath() + "/bans.journal"; }
+    CString OffendersFile() const { return GetSavePath() + "/offenders"; }
+
+    static CString FormatRecord(const CIPPrefix& Prefix, const BanInfo& Info) {
+        // The username comes from the client, it must not break the record
+        CString sUsername = Info.username;
+        sUsername.Replace("\t", "");
+        sUsername.Replace("\r", "");
+        sUsername.Replace("\n", "");
+
+        return Prefix.ToString() + "\t" + CString(Info.id) + "\t" +
+               CString(Info.attempts) + "\t" + CString(Info.first_attempt) +
+               "\t" + CString(Info.last_attempt) + "\t" +
+               CString(Info.expires) + "\t" + sUsername + "\t" +
+               CString(Info.duration);
+    }
+
+    void ApplyRecord(const CString& sRecord, time_t now) {
+        // Keep empty fields, bans added by hand have no username
+        VCString vsFields;
+        sRecord.Split("\t", vsFields, true);
+        vsFields.resize(8);
 
-    void Add(const CString& sHost, unsigned int count) {
+        CIPPrefix Prefix;
+        if (!CIPPrefix::Parse(vsFields[0], Prefix)) return;
+
+        BanInfo Info;
+        Info.id = vsFields[1].ToUInt();
+        Info.attempts = vsFields[2].ToUInt();
+        Info.first_attempt = vsFields[3].ToLongLong();
+        Info.last_attempt = vsFields[4].ToLongLong();
+        Info.expires = vsFields[5].ToLongLong();
+        Info.username = vsFields[6];
+        Info.duration = vsFields[7].ToLongLong();
+        if (Info.duration <= 0) Info.duration = m_uTTL;
+
+        // A later record always replaces an earlier one for the same prefix
+        EraseBan(Prefix);
+        if (Info.id == 0) return;
+
+        // Expired records still hold on to their ID
+        m_uNextId = std::max(m_uNextId, Info.id + 1);
+        if (IsExpired(Info, now)) return;
+
+        BanInfo& New = m_Bans.Insert(Prefix);
+        New = Info;
+        m_mIds[Info.id] = Prefix;
+        Reindex(New);
+    }
+
+    void LoadBans() {
         time_t now = time(nullptr);
-        BanInfo* pInfo = m_Cache.GetItem(sHost);
+        CString sLine;
+
+        // Oldest first, so the most recent offender ends up in front
+        CFile Offenders(OffendersFile());
+        if (Offenders.Open()) {
+            while (Offenders.ReadLine(sLine)) {
+                sLine.TrimRight("\r\n");
+                CIPPrefix Prefix;
+                if (!CIPPrefix::Parse(sLine.Token(0, false, "\t"), Prefix))
+                    continue;
+
+                Offender& History = FindOffender(Prefix);
+                History.bans = sLine.Token(1, false, "\t").ToUInt();
+                History.last_ban =
+                    (time_t)sLine.Token(2, false, "\t").ToLongLong();
+            }
+            Offenders.Close();
+        }
+
+        CFile Bans(BansFile());
+        if (Bans.Open()) {
+            while (Bans.ReadLine(sLine)) {
+                sLine.TrimRight("\r\n");
+                if (!sLine.empty()) ApplyRecord(sLine, now);
+            }
+            Bans.Close();
+        }
+
+        CFile Journal(JournalFile());
+        if (Journal.Open()) {
+            while (Journal.ReadLine(sLine)) {
+                sLine.TrimRight("\r\n");
+                CString sOp = sLine.Token(0, false, "\t");
+                CString sRecord = sLine.Token(1, true, "\t");
+
+                CIPPrefix Prefix;
+                if (sOp == "+") {
+                    ApplyRecord(sRecord, now);
+                } else if (sOp == "-" && CIPPrefix::Parse(sRecord, Prefix)) {
+                    EraseBan(Prefix);
+                }
+            }
+            Journal.Close();
+        }
 
+        CompactBans();
+    }
+
+    void Journal(const CIPPrefix& Prefix, const BanInfo* pInfo) {
         if (pInfo) {
-            pInfo->attempts = count;
-            pInfo->last_attempt = now;
+            m_vsJournal.push_back("+\t" + FormatRecord(Prefix, *pInfo));
+        } else {
+            m_vsJournal.push_back("-\t" + Prefix.ToString());
+        }
+    }
+
+    // Rewrites the snapshot from the in-memory table and drops the journal
+    void CompactBans() {
+        time_t now = time(nullptr);
+        CString sTmp = BansFile() + ".tmp";
+
+        CFile Bans(sTmp);
+        if (!Bans.Open(O_WRONLY | O_CREAT | O_TRUNC, 0600)) {
+            DEBUG("fail2ban: unable to write [" << sTmp << "]");
+            return;
+        }
+
+        m_Bans.ForEach([&](const CIPPrefix& Prefix, BanInfo& Info) {
+            if (!IsExpired(Info, now))
+                Bans.Write(FormatRecord(Prefix, Info) + "\n");
+        });
+        Bans.Close();
+
+        if (!CFile::Move(sTmp, BansFile(), true)) {
+            DEBUG("fail2ban: unable to replace [" << BansFile() << "]");
+            return;
+        }
+
+        CFile::Delete(JournalFile());
+        m_vsJournal.clear();
+        m_uJournalLines = 0;
+
+        // Don't hand out IDs of entries that expired before a restart again
+        SetNV("next_id", CString(m_uNextId));
+        SaveOffenders();
+    }
+
+    void SaveOffenders() {
+        time_t now = time(nullptr);
+        CString sTmp = OffendersFile() + ".tmp";
+
+        CFile Offenders(sTmp);
+        if (!Offenders.Open(O_WRONLY | O_CREAT | O_TRUNC, 0600)) {
+            DEBUG("fail2ban: unable to write [" << sTmp << "]");
+            return;
+        }
+
+        for (auto it = m_lOffenders.rbegin(); it != m_lOffenders.rend(); ++it) {
+            if (now - it->second.last_ban >= HISTORY_FORGET) continue;
+            Offenders.Write(it->first.ToString() + "\t" +
+                            CString(it->second.bans) + "\t" +
+                            CString(it->second.last_ban) + "\n");
+        }
+        Offenders.Close();
+
+        CFile::Move(sTmp, OffendersFile(), true);
+    }
+
+    // Returns the history of a prefix, creating it if needed, and marks it
+    // as the most recently used one. The least recently used history is
+    // dropped once there are more than HISTORY_SIZE.
+    Offender& FindOffender(const CIPPrefix& Prefix) {
+        CString sKey = Prefix.ToString();
+        auto it = m_mOffenders.find(sKey);
+
+        if (it != m_mOffenders.end()) {
+            m_lOffenders.splice(m_lOffenders.begin(), m_lOffenders,
+                                it->second);
+            return it->second->second;
+        }
+
+        m_lOffenders.emplace_front(Prefix, Offender{0, 0});
+        m_mOffenders[sKey] = m_lOffenders.begin();
+
+        if (m_lOffenders.size() > HISTORY_SIZE) {
+            m_mOffenders.erase(m_lOffenders.back().first.ToString());
+            m_lOffenders.pop_back();
+        }
+
+        return m_lOffenders.front().second;
+    }
+
+    unsigned int GetOffenses(const CIPPrefix& Prefix) const {
+        auto it = m_mOffenders.find(Prefix.ToString());
+        if (it == m_mOffenders.end()) return 0;
+
+        const Offender& History = it->second->second;
+        if (time(nullptr) - History.last_ban >= HISTORY_FORGET) return 0;
+        return History.bans;
+    }
+
+    // Called when an entry reaches the allowed number of attempts. Every ban
+    // within HISTORY_FORGET of the previous one lasts m_dEscalate times
+    // longer, up to m_uEscalateMax minutes.
+    void Escalate(const CIPPrefix& Prefix, BanInfo& Info, time_t now) {
+        Offender& History = FindOffender(Prefix);
+        if (now - History.last_ban >= HISTORY_FORGET) History.bans = 0;
+
+        double dDuration = m_uTTL * std::pow(m_dEscalate, History.bans);
+        Info.duration = (time_t)std::min<double>(
+            dDuration, std::max(m_uTTL, m_uEscalateMax * 60));
+
+        History.bans++;
+        History.last_ban = now;
+        m_BansIssued.Add(now);
+    }
+
+    void FlushJournal() {
+        if (m_vsJournal.empty()) return;
+
+        CFile Journal(JournalFile());
+        if (!Journal.Open(O_WRONLY | O_APPEND | O_CREAT, 0600)) {
+            DEBUG("fail2ban: unable to write [" << JournalFile() << "]");
+            return;
+        }
+
+        for (const CString& sLine : m_vsJournal) Journal.Write(sLine + "\n");
+        Journal.Close();
+
+        m_uJournalLines += m_vsJournal.size();
+        m_vsJournal.clear();
+
+        if (m_uJournalLines > std::max<size_t>(1000, m_Bans.size() * 2))
+            CompactBans();
+    }
+
+    // Takes a token from the prefix's bucket, false if there was none left
+    bool AllowConnect(const CIPPrefix& Addr) {
+        if (m_uConnBurst == 0) return true;
+
+        CIPPrefix Prefix = GetTrackedPrefix(Addr);
+        ConnBucket* pBucket = m_Buckets.Find(Prefix);
+
+        if (!pBucket) {
+            // Same cap as the ban table. When every bucket is in use even
+            // after pruning, new sources aren't limited rather than refused.
+            if (m_Buckets.size() >= m_uMaxEntries) PruneBuckets();
+            if (m_Buckets.size() >= m_uMaxEntries) return true;
+
+            pBucket = &m_Buckets.Insert(Prefix);
+            *pBucket = {CTokenBucket(m_uConnBurst, m_uConnPerMin / 60.0),
+                        false};
+        }
+
+        if (!pBucket->tokens.TryTake()) {
+            if (!pBucket->logged) {
+                DEBUG("fail2ban: refusing connections from ["
+                      << Prefix.ToString() << "], more than " << m_uConnBurst
+                      << " at once");
+                pBucket->logged = true;
+            }
+            return false;
+        }
+        pBucket->logged = false;
+        return true;
+    }
+
+    // A full bucket is the same as no bucket, so those are dropped
+    void PruneBuckets() {
+        std::vector<CIPPrefix> vIdle;
+
+        m_Buckets.ForEach([&](const CIPPrefix& Prefix, ConnBucket& Bucket) {
+            if (Bucket.tokens.IsFull()) vIdle.push_back(Prefix);
+        });
+
+        for (const CIPPrefix& Prefix : vIdle) m_Buckets.Remove(Prefix);
+    }
+
+    // Creates an entry with a fresh ID. IDs are never reused, so an ID seen
+    // in List always refers to the same entry until it is removed.
+    BanInfo& NewBan(const CIPPrefix& Prefix, time_t now) {
+        EraseBan(Prefix);
+
+        while (m_Bans.size() >= m_uMaxEntries && !m_sEvict.empty()) {
+            auto it = m_mIds.find(std::get<2>(*m_sEvict.begin()));
+            CIPPrefix Victim = it->second;
+            Remove(Victim);
+            m_uEvicted++;
+        }
+
+        BanInfo& Info = m_Bans.Insert(Prefix);
+        Info.id = m_uNextId++;
+        Info.first_attempt = now;
+        Info.last_attempt = now;
+        Info.duration = m_uTTL;
+        m_mIds[Info.id] = Prefix;
+        return Info;
+    }
+
+    // Drops an expired entry and counts it in the stats
+    void ExpireBan(const CIPPrefix& Prefix, time_t now) {
+        BanInfo* pInfo = m_Bans.Find(Prefix);
+        if (!pInfo) return;
+
+        if (pInfo->attempts >= m_uiAllowedFailed) m_BansExpired.Add(now);
+        EraseBan(Prefix);
+        m_uExpired++;
+    }
+
+    // Drops an entry from the table and the ID index without journaling it
+    bool EraseBan(const CIPPrefix& Prefix) {
+        BanInfo* pInfo = m_Bans.Find(Prefix);
+        if (!pInfo) return false;
+
+        m_mIds.erase(pInfo->id);
+        m_sEvict.erase(pInfo->evict_key);
+        return m_Bans.Remove(Prefix);
+    }
+
+    void Touch(const CIPPrefix& Prefix, BanInfo& Info, time_t now) {
+        Info.last_attempt = now;
+        Info.expires = now + Info.duration;
+        Reindex(Info);
+        Journal(Prefix, &Info);
+    }
+
+    // Updates the eviction order and makes sure the entry is on the wheel
+    void Reindex(BanInfo& Info) {
+        m_sEvict.erase(Info.evict_key);
+        Info.evict_key = std::make_tuple(Info.attempts, Info.last_attempt,
+                                         Info.id);
+        m_sEvict.insert(Info.evict_key);
+
+        // An entry whose expiry moved later stays in its slot and gets
+        // queued again when the slot comes around
+        if (Info.wheel_at == 0) {
+            Info.wheel_at = std::max(Info.expires, m_tWheelTime + 1);
+            m_vWheel[Info.wheel_at % WHEEL_SLOTS].push_back(Info.id);
+        }
+    }
+
+    // Hashed timing wheel with one slot per second. Every entry sits in
+    // exactly one slot, so expiring costs O(1) per entry and revolution.
+    void ExpireBans() {
+        time_t now = time(nullptr);
+        if (now <= m_tWheelTime) return;
+
+        time_t tStart = std::max(m_tWheelTime + 1, now - WHEEL_SLOTS + 1);
+        for (time_t t = tStart; t <= now; t++) {
+            m_tWheelTime = t;
+
+            std::vector<unsigned int> vIds;
+            vIds.swap(m_vWheel[t % WHEEL_SLOTS]);
+
+            for (unsigned int id : vIds) {
+                auto it = m_mIds.find(id);
+                if (it == m_mIds.end()) continue;
+
+                CIPPrefix Prefix = it->second;
+                BanInfo* pInfo = m_Bans.Find(Prefix);
+                if (IsExpired(*pInfo, now)) {
+                    ExpireBan(Prefix, now);
+                } else {
+                    pInfo->wheel_at = 0;
+                    Reindex(*pInfo);
+                }
+            }
+        }
+        m_tWheelTime = now;
+    }
+
+    // The prefix failed logins from this address are counted against
+    CIPPrefix GetTrackedPrefix(const CIPPrefix& Addr) const {
+        return Addr.Masked(Addr.IsV4() ? 96 + m_uV4Prefix : m_uV6Prefix);
+    }
+
+    // Returns the first unexpired entry covering the address that has
+    // reached the allowed number of attempts
+    BanInfo* FindBan(const CIPPrefix& Addr, CIPPrefix& BanPrefix) {
+        time_t now = time(nullptr);
+        BanInfo* pBan = nullptr;
+        std::vector<CIPPrefix> vExpired;
+
+        m_Bans.ForEachMatch(Addr, [&](const CIPPrefix& Prefix, BanInfo& Info) {
+            if (IsExpired(Info, now)) {
+                vExpired.push_back(Prefix);
+            } else if (!pBan && Info.attempts >= m_uiAllowedFailed) {
+                pBan = &Info;
+                BanPrefix = Prefix;
+            }
+        });
+
+        for (const CIPPrefix& Prefix : vExpired) ExpireBan(Prefix, now);
+        return pBan;
+    }
+
+    void Add(const CIPPrefix& Prefix, unsigned int count) {
+        time_t now = time(nullptr);
+        BanInfo* pInfo = m_Bans.Find(Prefix);
+
+        if (pInfo && !IsExpired(*pInfo, now)) {
             // Keep the original first_attempt time
-            m_Cache.AddItem(sHost, *pInfo, m_Cache.GetTTL());
+            bool bWasBanned = pInfo->attempts >= m_uiAllowedFailed;
+            pInfo->attempts = count;
+            if (!bWasBanned) Escalate(Prefix, *pInfo, now);
+            Touch(Prefix, *pInfo, now);
         } else {
-            BanInfo info = {count, now, now};
-            m_Cache.AddItem(sHost, info, m_Cache.GetTTL());
+            BanInfo& Info = NewBan(Prefix, now);
+            Info.attempts = count;
+            Escalate(Prefix, Info, now);
+            Touch(Prefix, Info, now);
         }
     }
 
-    bool Remove(const CString& sHost) { return m_Cache.RemItem(sHost); }
+    bool Remove(const CIPPrefix& Prefix) {
+        if (!EraseBan(Prefix)) return false;
+        Journal(Prefix, nullptr);
+        return true;
+    }
 
     void OnTimeoutCommand(const CString& sCommand) {
         if (!GetUser()->IsAdmin()) {
@@ -97,13 +950,13 @@ class CFailToBanMod : public CModule {
             if (uTimeout == 0) {
                 PutModule(t_s("Usage: Timeout [minutes]"));
             } else {
-                m_Cache.SetTTL(uTimeout * 60 * 1000);
-                SetArgs(CString(m_Cache.GetTTL() / 60 / 1000) + " " +
+                m_uTTL = uTimeout * 60;
+                SetArgs(CString(m_uTTL / 60) + " " +
                         CString(m_uiAllowedFailed));
                 PutModule(t_f("Timeout: {1} min")(uTimeout));
             }
         } else {
-            PutModule(t_f("Timeout: {1} min")(m_Cache.GetTTL() / 60 / 1000));
+            PutModule(t_f("Timeout: {1} min")(m_uTTL / 60));
         }
     }
 
@@ -121,7 +974,7 @@ class CFailToBanMod : public CModule {
                 PutModule(t_s("Usage: Attempts [count]"));
             } else {
                 m_uiAllowedFailed = uiAttempts;
-                SetArgs(CString(m_Cache.GetTTL() / 60 / 1000) + " " +
+                SetArgs(CString(m_uTTL / 60) + " " +
                         CString(m_uiAllowedFailed));
                 PutModule(t_f("Attempts: {1}")(uiAttempts));
             }
@@ -147,9 +1000,73 @@ class CFailToBanMod : public CModule {
         sHosts.Split(" ", vsHosts, false, "", "", true, true);
 
         for (const CString& sHost : vsHosts) {
+            CIPPrefix Prefix;
+            if (!CIPPrefix::Parse(sHost, Prefix)) {
+                PutModule(t_f("Invalid IP address or CIDR range: {1}")(sHost));
+                continue;
+            }
+
             // Ban with max attempts to ensure they're blocked
-            Add(sHost, m_uiAllowedFailed);
-            PutModule(t_f("Banned: {1}")(sHost));
+            Add(Prefix, m_uiAllowedFailed);
+            PutModule(t_f("Banned: {1}")(Prefix.ToString()));
+        }
+    }
+
+    void OnPrefixCommand(const CString& sCommand) {
+        if (!GetUser()->IsAdmin()) {
+            PutModule(t_s("Access denied"));
+            return;
+        }
+
+        CString sV4 = sCommand.Token(1);
+        CString sV6 = sCommand.Token(2);
+
+        if (!sV4.empty()) {
+            unsigned int uV4 = sV4.ToUInt();
+            unsigned int uV6 = sV6.empty() ? m_uV6Prefix : sV6.ToUInt();
+            if (uV4 == 0 || uV4 > 32 || uV6 == 0 || uV6 > 128) {
+                PutModule(t_s("Usage: Prefix [IPv4 bits] [IPv6 bits]"));
+                return;
+            }
+
+            m_uV4Prefix = uV4;
+            m_uV6Prefix = uV6;
+            SetNV("ipv4_prefix", CString(m_uV4Prefix));
+            SetNV("ipv6_prefix", CString(m_uV6Prefix));
+        }
+
+        PutModule(t_f("Failed logins are counted per IPv4 /{1} and IPv6 /{2}")(
+            m_uV4Prefix, m_uV6Prefix));
+    }
+
+    void OnConnectLimitCommand(const CString& sCommand) {
+        if (!GetUser()->IsAdmin()) {
+            PutModule(t_s("Access denied"));
+            return;
+        }
+
+        CString sBurst = sCommand.Token(1);
+        CString sRate = sCommand.Token(2);
+
+        if (!sBurst.empty()) {
+            unsigned int uRate = sRate.empty() ? m_uConnPerMin : sRate.ToUInt();
+            if (CString(sBurst.ToUInt()) != sBurst || uRate == 0) {
+                PutModule(t_s("Usage: ConnectLimit [burst] [per minute]"));
+                return;
+            }
+
+            m_uConnBurst = sBurst.ToUInt();
+            m_uConnPerMin = uRate;
+            SetNV("connect_burst", CString(m_uConnBurst));
+            SetNV("connect_rate", CString(m_uConnPerMin));
+            m_Buckets.Clear();
+        }
+
+        if (m_uConnBurst == 0) {
+            PutModule(t_s("Connections are not rate limited"));
+        } else {
+            PutModule(t_f("Connections per prefix: burst {1}, then {2} per "
+                          "minute")(m_uConnBurst, m_uConnPerMin));
         }
     }
 
@@ -174,24 +1091,25 @@ class CFailToBanMod : public CModule {
 
             // Check if it's a numeric ID by trying to convert and validating
             unsigned int targetId = sTarget.ToUInt();
+            CIPPrefix Prefix;
             if (targetId > 0 && CString(targetId) == sTarget) {
                 // Find host by ID
-                unsigned int currentId = 1;
-                for (const auto& it : m_Cache.GetItems()) {
-                    if (currentId == targetId) {
-                        if (Remove(it.first)) {
-                            PutModule(t_f("Unbanned ID {1} ({2})")(targetId,
-                                                                   it.first));
-                            bUnbanned = true;
-                        }
-                        break;
+                auto it = m_mIds.find(targetId);
+                if (it != m_mIds.end()) {
+                    Prefix = it->second;
+                    if (Remove(Prefix)) {
+                        PutModule(t_f("Unbanned ID {1} ({2})")(
+                            targetId, Prefix.ToString()));
+                        bUnbanned = true;
                     }
-                    currentId++;
                 }
-            } else {
-                // Treat as hostname/IP
-                if (Remove(sTarget)) {
-                    PutModule(t_f("Unbanned: {1}")(sTarget));
+            } else if (CIPPrefix::Parse(sTarget, Prefix)) {
+                // Treat as IP or CIDR range. Failed logins from a single
+                // address are kept under its tracked prefix.
+                if (Prefix.GetLen() == 128 && !m_Bans.Find(Prefix))
+                    Prefix = GetTrackedPrefix(Prefix);
+                if (Remove(Prefix)) {
+                    PutModule(t_f("Unbanned: {1}")(Prefix.ToString()));
                     bUnbanned = true;
                 }
             }
@@ -214,63 +1132,137 @@ class CFailToBanMod : public CModule {
         Table.AddColumn(t_s("Username", "list"));
         Table.AddColumn(t_s("Host", "list"));
         Table.AddColumn(t_s("Attempts", "list"));
+        Table.AddColumn(t_s("Bans", "list"));
         Table.AddColumn(t_s("First Seen", "list"));
         Table.AddColumn(t_s("Last Seen", "list"));
         Table.AddColumn(t_s("Expires In", "list"));
         Table.SetStyle(CTable::ListStyle);
 
-        unsigned int id = 1;
-        for (const auto& it : m_Cache.GetItems()) {
+        std::vector<CIPPrefix> vExpired;
+        std::vector<std::pair<CIPPrefix, const BanInfo*>> vBans;
+        m_Bans.ForEach([&](const CIPPrefix& Prefix, BanInfo& Info) {
+            if (IsExpired(Info, now)) {
+                vExpired.push_back(Prefix);
+            } else {
+                vBans.emplace_back(Prefix, &Info);
+            }
+        });
+
+        std::sort(vBans.begin(), vBans.end(),
+                  [](const std::pair<CIPPrefix, const BanInfo*>& a,
+                     const std::pair<CIPPrefix, const BanInfo*>& b) {
+                      return a.second->id < b.second->id;
+                  });
+
+        for (const auto& it : vBans) {
+            const CIPPrefix& Prefix = it.first;
+            const BanInfo& Info = *it.second;
+
             Table.AddRow();
-            Table.SetCell(t_s("ID", "list"), CString(id++));
-            Table.SetCell(t_s("Username", "list"), it.second.username);
-            Table.SetCell(t_s("Host", "list"), it.first);
-            Table.SetCell(t_s("Attempts", "list"), CString(it.second.attempts));
+            Table.SetCell(t_s("ID", "list"), CString(Info.id));
+            Table.SetCell(t_s("Username", "list"), Info.username);
+            Table.SetCell(t_s("Host", "list"), Prefix.ToString());
+            Table.SetCell(t_s("Attempts", "list"), CString(Info.attempts));
+            Table.SetCell(t_s("Bans", "list"), CString(GetOffenses(Prefix)));
             // Format timestamps
             CString sFirstSeen =
-                CUtils::FormatTime(it.second.first_attempt, "%Y-%m-%d %H:%M:%S",
+                CUtils::FormatTime(Info.first_attempt, "%Y-%m-%d %H:%M:%S",
                                    GetUser()->GetTimezone());
             CString sLastSeen =
-                CUtils::FormatTime(it.second.last_attempt, "%Y-%m-%d %H:%M:%S",
+                CUtils::FormatTime(Info.last_attempt, "%Y-%m-%d %H:%M:%S",
                                    GetUser()->GetTimezone());
 
             Table.SetCell(t_s("First Seen", "list"), sFirstSeen);
             Table.SetCell(t_s("Last Seen", "list"), sLastSeen);
             // Calculate remaining time
-            time_t ttl_seconds =
-                m_Cache.GetTTL() / 1000;  // Convert ms to seconds
-            time_t elapsed = now - it.second.last_attempt;
-            time_t remaining = ttl_seconds - elapsed;
-
-            CString sCountdown;
-            if (remaining <= 0) {
-                sCountdown = "Expired";
-            } else {
-                sCountdown = FormatDuration(remaining);
-            }
+            time_t remaining = Info.expires - now;
 
-            Table.SetCell(t_s("Expires In", "list"), sCountdown);
+            Table.SetCell(t_s("Expires In", "list"), FormatDuration(remaining));
         }
 
+        for (const CIPPrefix& Prefix : vExpired) ExpireBan(Prefix, now);
+
         if (Table.empty()) {
             PutModule(t_s("No bans", "list"));
         } else {
             PutModule(Table);
         }
+
+        PutModule(t_f("Tracking {1} of at most {2} hosts, {3} expired and {4} "
+                      "evicted since load")(m_Bans.size(), m_uMaxEntries,
+                                            m_uExpired, m_uEvicted));
+    }
+
+    void OnMaxEntriesCommand(const CString& sCommand) {
+        if (!GetUser()->IsAdmin()) {
+            PutModule(t_s("Access denied"));
+            return;
+        }
+
+        CString sArg = sCommand.Token(1);
+
+        if (!sArg.empty()) {
+            unsigned int uMax = sArg.ToUInt();
+            if (uMax == 0) {
+                PutModule(t_s("Usage: MaxEntries [count]"));
+                return;
+            }
+
+            m_uMaxEntries = uMax;
+            SetNV("max_entries", CString(m_uMaxEntries));
+        }
+
+        PutModule(t_f("MaxEntries: {1}")(m_uMaxEntries));
+    }
+
+    void OnEscalateCommand(const CString& sCommand) {
+        if (!GetUser()->IsAdmin()) {
+            PutModule(t_s("Access denied"));
+            return;
+        }
+
+        CString sFactor = sCommand.Token(1);
+        CString sMax = sCommand.Token(2);
+
+        if (!sFactor.empty()) {
+            double dFactor = sFactor.ToDouble();
+            unsigned int uMax = sMax.empty() ? m_uEscalateMax : sMax.ToUInt();
+            if (dFactor < 1 || uMax == 0) {
+                PutModule(t_s("Usage: Escalate [factor] [max minutes]"));
+                return;
+            }
+
+            m_dEscalate = dFactor;
+            m_uEscalateMax = uMax;
+            SetNV("escalate_factor", CString(m_dEscalate));
+            SetNV("escalate_max", CString(m_uEscalateMax));
+        }
+
+        PutModule(t_f("Repeated bans last {1} times longer, up to {2} min")(
+            CString(m_dEscalate), m_uEscalateMax));
     }
 
     void OnClientConnect(CZNCSock* pClient, const CString& sHost,
                          unsigned short uPort) override {
-        BanInfo* pInfo = m_Cache.GetItem(sHost);
-        if (sHost.empty() || pInfo == nullptr ||
-            pInfo->attempts < m_uiAllowedFailed) {
+        CIPPrefix Addr;
+        if (!CIPPrefix::Parse(sHost, Addr)) return;
+
+        // This runs right after accept(), drop floods before they cost us a
+        // TLS handshake or a CClient
+        if (!AllowConnect(Addr)) {
+            m_RefusedConnects.Add(time(nullptr));
+            pClient->Close(Csock::CLT_NOW);
             return;
         }
 
+        CIPPrefix BanPrefix;
+        BanInfo* pInfo = FindBan(Addr, BanPrefix);
+        if (pInfo == nullptr) return;
+
+        m_RefusedConnects.Add(time(nullptr));
+
         // Refresh their ban with updated timestamp
-        time_t now = time(nullptr);
-        pInfo->last_attempt = now;
-        m_Cache.AddItem(sHost, *pInfo, m_Cache.GetTTL());
+        Touch(BanPrefix, *pInfo, time(nullptr));
 
         pClient->Write(
             "ERROR :Closing link [Please try again later - reconnecting too "
@@ -280,28 +1272,44 @@ class CFailToBanMod : public CModule {
 
     void OnFailedLogin(const CString& sUsername,
                        const CString& sRemoteIP) override {
+        CIPPrefix Addr;
+        if (!CIPPrefix::Parse(sRemoteIP, Addr)) return;
+
+        CIPPrefix Prefix = GetTrackedPrefix(Addr);
         time_t now = time(nullptr);
-        BanInfo* pInfo = m_Cache.GetItem(sRemoteIP);
+        BanInfo* pInfo = m_Bans.Find(Prefix);
 
-        if (pInfo) {
-            pInfo->attempts++;
-            pInfo->last_attempt = now;
-            pInfo->username = sUsername;  // Update username
-            m_Cache.AddItem(sRemoteIP, *pInfo, m_Cache.GetTTL());
-        } else {
-            BanInfo info = {1, now, now, sUsername};  // Include username
-            m_Cache.AddItem(sRemoteIP, info, m_Cache.GetTTL());
+        m_FailedLogins.Add(now);
+        if (!sUsername.empty()) m_TopUsernames.Add(sUsername);
+        m_TopPrefixes.Add(Prefix.ToString());
+
+        if (!pInfo || IsExpired(*pInfo, now)) {
+            pInfo = &NewBan(Prefix, now);
         }
+
+        pInfo->attempts++;
+        pInfo->username = sUsername;  // Update username
+        if (pInfo->attempts == m_uiAllowedFailed)
+            Escalate(Prefix, *pInfo, now);
+        Touch(Prefix, *pInfo, now);
+    }
+
+    void OnClientLogin() override {
+        CIPPrefix Addr;
+        if (CIPPrefix::Parse(GetClient()->GetRemoteIP(), Addr))
+            Remove(GetTrackedPrefix(Addr));
     }
 
-    void OnClientLogin() override { Remove(GetClient()->GetRemoteIP()); }
     EModRet OnLoginAttempt(std::shared_ptr<CAuthBase> Auth) override {
-        const CString& sRemoteIP = Auth->GetRemoteIP();
-        if (sRemoteIP.empty()) return CONTINUE;
+        CIPPrefix Addr;
+        if (!CIPPrefix::Parse(Auth->GetRemoteIP(), Addr)) return CONTINUE;
 
-        BanInfo* pInfo = m_Cache.GetItem(sRemoteIP);
-        if (pInfo && pInfo->attempts >= m_uiAllowedFailed) {
-            // OnFailedLogin() will refresh their ban
+        CIPPrefix BanPrefix;
+        BanInfo* pInfo = FindBan(Addr, BanPrefix);
+        if (pInfo) {
+            // A range ban isn't necessarily the entry OnFailedLogin() bumps
+            Touch(BanPrefix, *pInfo, time(nullptr));
+            m_RefusedLogins.Add(time(nullptr));
             Auth->RefuseLogin("Please try again later - reconnecting too fast");
             return HALT;
         }
@@ -309,6 +1317,104 @@ class CFailToBanMod : public CModule {
         return CONTINUE;
     }
 
+    void OnStatsCommand(const CString& sCommand) {
+        if (!GetUser()->IsAdmin()) {
+            PutModule(t_s("Access denied"));
+            return;
+        }
+
+        time_t now = time(nullptr);
+
+        CTable Table;
+        Table.AddColumn(t_s("Event", "stats"));
+        Table.AddColumn(t_s("Per Second", "stats"));
+        Table.AddColumn(t_s("Last Minute", "stats"));
+        Table.AddColumn(t_s("Last Hour", "stats"));
+        Table.AddColumn(t_s("Total", "stats"));
+
+        for (const auto& it : GetCounters()) {
+            Counter& Count = *it.second;
+            Table.AddRow();
+            Table.SetCell(t_s("Event", "stats"), it.first);
+            Table.SetCell(t_s("Per Second", "stats"),
+                          CString(Count.minute.Sum(now) / 60.0, 2));
+            Table.SetCell(t_s("Last Minute", "stats"),
+                          CString(Count.minute.Sum(now)));
+            Table.SetCell(t_s("Last Hour", "stats"),
+                          CString(Count.hour.Sum(now)));
+            Table.SetCell(t_s("Total", "stats"), CString(Count.total));
+        }
+        PutModule(Table);
+
+        for (const auto& it : GetTopCounters()) {
+            CTable Top;
+            Top.AddColumn(it.first);
+            Top.AddColumn(t_s("Failed Logins", "stats"));
+            for (const auto& Entry : it.second->Top(10)) {
+                Top.AddRow();
+                Top.SetCell(it.first, Entry.first);
+                Top.SetCell(t_s("Failed Logins", "stats"),
+                            CString(Entry.second));
+            }
+            if (!Top.empty()) PutModule(Top);
+        }
+
+        PutModule(t_f("Tracking {1} hosts, {2} connection buckets")(
+            m_Bans.size(), m_Buckets.size()));
+    }
+
+    std::vector<std::pair<CString, Counter*>> GetCounters() {
+        return {{t_s("Failed logins", "stats"), &m_FailedLogins},
+                {t_s("Refused connections", "stats"), &m_RefusedConnects},
+                {t_s("Refused logins", "stats"), &m_RefusedLogins},
+                {t_s("Bans issued", "stats"), &m_BansIssued},
+                {t_s("Bans expired", "stats"), &m_BansExpired}};
+    }
+
+    std::vector<std::pair<CString, CTopCounter*>> GetTopCounters() {
+        return {{t_s("Username", "stats"), &m_TopUsernames},
+                {t_s("Host", "stats"), &m_TopPrefixes}};
+    }
+
+    bool WebRequiresAdmin() override { return true; }
+    CString GetWebMenuTitle() override { return t_s("Fail2Ban"); }
+
+    bool OnWebRequest(CWebSock& WebSock, const CString& sPageName,
+                      CTemplate& Tmpl) override {
+        if (sPageName != "index") return false;
+
+        time_t now = time(nullptr);
+
+        for (const auto& it : GetCounters()) {
+            Counter& Count = *it.second;
+            CTemplate& Row = Tmpl.AddRow("CounterLoop");
+            Row["Event"] = it.first;
+            Row["PerSecond"] = CString(Count.minute.Sum(now) / 60.0, 2);
+            Row["LastMinute"] = CString(Count.minute.Sum(now));
+            Row["LastHour"] = CString(Count.hour.Sum(now));
+            Row["Total"] = CString(Count.total);
+        }
+
+        for (const auto& it : GetTopCounters()) {
+            CTemplate& Top = Tmpl.AddRow("TopLoop");
+            Top["Title"] = it.first;
+            for (const auto& Entry : it.second->Top(10)) {
+                CTemplate& Row = Top.AddRow("EntryLoop");
+                Row["Key"] = Entry.first;
+                Row["Count"] = CString(Entry.second);
+            }
+        }
+
+        Tmpl["Entries"] = CString(m_Bans.size());
+        Tmpl["MaxEntries"] = CString(m_uMaxEntries);
+        Tmpl["Expired"] = CString(m_uExpired);
+        Tmpl["Evicted"] = CString(m_uEvicted);
+        Tmpl["Attempts"] = CString(m_uiAllowedFailed);
+        Tmpl["Timeout"] = CString(m_uTTL / 60);
+
+        return true;
+    }
+
     CString FormatDuration(time_t seconds) {
         if (seconds <= 0) return "0s";
 
@@ -326,17 +1432,52 @@ class CFailToBanMod : public CModule {
     }
 
   private:
-    struct BanInfo {
-        unsigned int attempts;
-        time_t first_attempt;
-        time_t last_attempt;
-        CString username;
-    };
-
-    TCacheMap<CString, BanInfo> m_Cache;
+    CPrefixTrie<BanInfo> m_Bans;
+    std::unordered_map<unsigned int, CIPPrefix> m_mIds;
+    std::set<std::tuple<unsigned int, time_t, unsigned int>> m_sEvict;
+    std::vector<std::vector<unsigned int>> m_vWheel;
+    time_t m_tWheelTime = 0;
+    unsigned int m_uMaxEntries{};
+    unsigned long long m_uExpired = 0;
+    unsigned long long m_uEvicted = 0;
+    std::list<std::pair<CIPPrefix, Offender>> m_lOffenders;
+    std::unordered_map<std::string,
+                       std::list<std::pair<CIPPrefix, Offender>>::iterator>
+        m_mOffenders;
+    Counter m_FailedLogins;
+    Counter m_RefusedConnects;
+    Counter m_RefusedLogins;
+    Counter m_BansIssued;
+    Counter m_BansExpired;
+    CTopCounter m_TopUsernames{20};
+    CTopCounter m_TopPrefixes{20};
+    double m_dEscalate{};
+    unsigned int m_uEscalateMax{};
+    unsigned int m_uNextId = 1;
+    bool m_bLoaded = false;
+    VCString m_vsJournal;
+    size_t m_uJournalLines = 0;
+    unsigned int m_uTTL{};
     unsigned int m_uiAllowedFailed{};
+    unsigned int m_uV4Prefix{};
+    unsigned int m_uV6Prefix{};
+    CPrefixTrie<ConnBucket> m_Buckets;
+    unsigned int m_uConnBurst{};
+    unsigned int m_uConnPerMin{};
 };
 
+CFailToBanTimer::CFailToBanTimer(CFailToBanMod* pMod)
+    : CTimer(pMod, 5, 0, "FailToBanTimer",
+             "Writes the ban table to disk and prunes idle rate limits") {
+    m_pMod = pMod;
+}
+
+void CFailToBanTimer::RunJob() {
+    m_pMod->ExpireBans();
+    m_pMod->FlushJournal();
+    m_pMod->PruneBuckets();
+}
+
 template <>
 void TModInfo<CFailToBanMod>(CModInfo& Info) {
     Info.SetWikiPage("fail2ban");
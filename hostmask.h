@@ -0,0 +1,374 @@
+/*
+ * Copyright (C) 2004-2025 ZNC, see the NOTICE file for details.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Hostmask lists shared by autoaccept, autovoice, invite and notice.
+//
+// CHostmaskUser is a named set of hostmasks, saved in NV as
+// "username<TAB>mask,mask". CHostmaskIndex compiles the masks of many users
+// so that a nick!ident@host is looked up instead of WildCmp'ed against every
+// mask, and CHostmaskUsers keeps users, index and NV entries together.
+
+#ifndef ZNC_HOSTMASK_H
+#define ZNC_HOSTMASK_H
+
+#include <znc/Modules.h>
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+class CHostmaskUser {
+  public:
+    CHostmaskUser() {}
+
+    CHostmaskUser(const CString& sUsername, const CString& sHostmasks)
+        : m_sUsername(sUsername) {
+        AddHostmasks(sHostmasks);
+    }
+
+    virtual ~CHostmaskUser() {}
+
+    const CString& GetUsername() const { return m_sUsername; }
+
+    const std::set<CString>& GetHostmaskSet() const { return m_ssHostmasks; }
+
+    CString GetHostmasks() const {
+        return CString(",").Join(m_ssHostmasks.begin(), m_ssHostmasks.end());
+    }
+
+    // Returns true if no masks are left
+    bool DelHostmasks(const CString& sHostmasks) {
+        VCString vsHostmasks;
+        sHostmasks.Split(",", vsHostmasks);
+
+        for (const CString& s : vsHostmasks) {
+            m_ssHostmasks.erase(s);
+        }
+
+        return m_ssHostmasks.empty();
+    }
+
+    void AddHostmasks(const CString& sHostmasks) {
+        VCString vsHostmasks;
+        sHostmasks.Split(",", vsHostmasks);
+
+        for (const CString& s : vsHostmasks) {
+            m_ssHostmasks.insert(s);
+        }
+    }
+
+    // Modules with more to save append further tab separated fields
+    virtual CString ToString() const {
+        return m_sUsername + "\t" + GetHostmasks();
+    }
+
+    virtual bool FromString(const CString& sLine) {
+        m_sUsername = sLine.Token(0, false, "\t");
+        sLine.Token(1, false, "\t").Split(",", m_ssHostmasks);
+        return !m_sUsername.empty();
+    }
+
+  protected:
+    CString m_sUsername;
+    std::set<CString> m_ssHostmasks;
+};
+
+// Masks are sorted into tiers when added:
+//  - no wildcards at all: a hash lookup
+//  - literal prefix followed by *, like nick!*: a trie walked from the front
+//  - *, *!* or *!*@* followed by a literal suffix, like *!*@*.domain or
+//    *!*@host: a trie walked from the back
+//  - any nick with a literal ident, like *!~user@*.isp: WildCmp, but only the
+//    masks with the ident of the hostmask
+//  - anything else: WildCmp, one mask after the other, skipping masks whose
+//    longest literal part isn't in the hostmask at all
+// Hostmasks are expected in full nick!ident@host form, which is what lets
+// nick!*@* and *!*@*.domain count as a plain prefix or suffix.
+template <typename T>
+class CHostmaskIndex {
+  public:
+    typedef std::function<bool(T*)> AcceptFunc;
+
+    void Clear() {
+        m_mExact.clear();
+        m_Prefixes = STrieNode();
+        m_Suffixes = STrieNode();
+        m_mIdents.clear();
+        m_vWild.clear();
+    }
+
+    void Add(const CString& sMask, T* pValue) {
+        CString sLower = sMask.AsLower();
+        size_t uFirst = sLower.find_first_of("*?");
+        size_t uLast = sLower.rfind('*');
+
+        if (uFirst == CString::npos) {
+            m_mExact[sLower].push_back(pValue);
+            return;
+        }
+
+        CString sHead = sLower.substr(0, uLast + 1);
+        CString sSuffix = sLower.substr(uLast + 1);
+        bool bHeadAt = sHead.find('@') != CString::npos;
+        if ((sHead == "*" || sHead == "*@*" || sHead == "*!*" ||
+             sHead == "*!*@*") &&
+            sSuffix.find_first_of("?!") == CString::npos &&
+            !(bHeadAt && sSuffix.find('@') != CString::npos)) {
+            Insert(m_Suffixes, sSuffix.rbegin(), sSuffix.rend(), pValue);
+            return;
+        }
+
+        CString sPrefix = sLower.substr(0, uFirst);
+        CString sTail = sLower.substr(uFirst);
+        if (sTail == "*" ||
+            (sTail == "*@*" && sPrefix.find('@') == CString::npos) ||
+            (sTail == "*!*@*" &&
+             sPrefix.find_first_of("!@") == CString::npos)) {
+            Insert(m_Prefixes, sPrefix.begin(), sPrefix.end(), pValue);
+            return;
+        }
+
+        CString sIdent = Ident(sLower);
+        if (sLower.StartsWith("*!") && !sIdent.empty() &&
+            sIdent.find_first_of("*?") == CString::npos) {
+            m_mIdents[sIdent].push_back({sLower, "", pValue});
+            return;
+        }
+
+        VCString vsLiterals;
+        sLower.Replace("?", "*");
+        sLower.Split("*", vsLiterals, false);
+        CString sLongest;
+        for (const CString& s : vsLiterals) {
+            if (s.length() > sLongest.length()) sLongest = s;
+        }
+
+        m_vWild.push_back({sMask.AsLower(), sLongest, pValue});
+    }
+
+    // The first value with a mask matching sHostmask that fAccept agrees to
+    T* Find(const CString& sHostmask,
+            const AcceptFunc& fAccept = nullptr) const {
+        CString sLower = sHostmask.AsLower();
+
+        auto it = m_mExact.find(sLower);
+        if (it != m_mExact.end()) {
+            for (T* pValue : it->second) {
+                if (!fAccept || fAccept(pValue)) return pValue;
+            }
+        }
+
+        T* pValue = Walk(m_Prefixes, sLower.begin(), sLower.end(), fAccept);
+        if (pValue) return pValue;
+
+        pValue = Walk(m_Suffixes, sLower.rbegin(), sLower.rend(), fAccept);
+        if (pValue) return pValue;
+
+        auto itIdent = m_mIdents.find(Ident(sLower));
+        if (itIdent != m_mIdents.end()) {
+            for (const SWild& Wild : itIdent->second) {
+                if (sLower.WildCmp(Wild.sMask) &&
+                    (!fAccept || fAccept(Wild.pValue))) {
+                    return Wild.pValue;
+                }
+            }
+        }
+
+        for (const SWild& Wild : m_vWild) {
+            if (sLower.find(Wild.sLiteral) == CString::npos) continue;
+            if (sLower.WildCmp(Wild.sMask) &&
+                (!fAccept || fAccept(Wild.pValue))) {
+                return Wild.pValue;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Find() for each of vsHostmasks, the results are in the same order
+    std::vector<T*> FindEach(const VCString& vsHostmasks,
+                             const AcceptFunc& fAccept = nullptr) const {
+        std::vector<T*> vResults;
+        vResults.reserve(vsHostmasks.size());
+
+        for (const CString& sHostmask : vsHostmasks) {
+            vResults.push_back(Find(sHostmask, fAccept));
+        }
+
+        return vResults;
+    }
+
+  private:
+    // What's between ! and @, empty if there is no such thing
+    static CString Ident(const CString& sMask) {
+        size_t uBang = sMask.find('!');
+        size_t uAt = sMask.find('@');
+        if (uBang == CString::npos || uAt == CString::npos || uAt < uBang) {
+            return "";
+        }
+        return sMask.substr(uBang + 1, uAt - uBang - 1);
+    }
+
+    // A value sits on the node its prefix (or reversed suffix) ends on
+    struct STrieNode {
+        std::map<char, std::unique_ptr<STrieNode>> mChildren;
+        std::vector<T*> vValues;
+    };
+
+    template <typename It>
+    static void Insert(STrieNode& Root, It begin, It end, T* pValue) {
+        STrieNode* pNode = &Root;
+        for (It c = begin; c != end; ++c) {
+            std::unique_ptr<STrieNode>& pChild = pNode->mChildren[*c];
+            if (!pChild) pChild.reset(new STrieNode);
+            pNode = pChild.get();
+        }
+        pNode->vValues.push_back(pValue);
+    }
+
+    template <typename It>
+    static T* Walk(const STrieNode& Root, It begin, It end,
+                   const AcceptFunc& fAccept) {
+        const STrieNode* pNode = &Root;
+        for (It c = begin; pNode; ++c) {
+            for (T* pValue : pNode->vValues) {
+                if (!fAccept || fAccept(pValue)) return pValue;
+            }
+            if (c == end) break;
+
+            auto it = pNode->mChildren.find(*c);
+            pNode = it == pNode->mChildren.end() ? nullptr : it->second.get();
+        }
+        return nullptr;
+    }
+
+    struct SWild {
+        CString sMask;
+        CString sLiteral;
+        T* pValue;
+    };
+
+    std::unordered_map<std::string, std::vector<T*>> m_mExact;
+    STrieNode m_Prefixes;
+    STrieNode m_Suffixes;
+    std::unordered_map<std::string, std::vector<SWild>> m_mIdents;
+    std::vector<SWild> m_vWild;
+};
+
+// Owns the users of a module, keyed by lower case username
+template <typename TUser>
+class CHostmaskUsers {
+  public:
+    CHostmaskUsers() {}
+    CHostmaskUsers(const CHostmaskUsers&) = delete;
+    CHostmaskUsers& operator=(const CHostmaskUsers&) = delete;
+
+    ~CHostmaskUsers() {
+        for (const auto& it : m_msUsers) {
+            delete it.second;
+        }
+    }
+
+    // Every NV entry is a user, broken entries and duplicates are skipped
+    void Load(CModule* pMod) {
+        for (MCString::iterator it = pMod->BeginNV(); it != pMod->EndNV();
+             ++it) {
+            TUser* pUser = new TUser;
+
+            if (!pUser->FromString(it->second) ||
+                FindUser(pUser->GetUsername())) {
+                delete pUser;
+            } else {
+                m_msUsers[pUser->GetUsername().AsLower()] = pUser;
+            }
+        }
+
+        Reindex();
+    }
+
+    void Save(CModule* pMod, const TUser* pUser) const {
+        pMod->SetNV(pUser->GetUsername(), pUser->ToString());
+    }
+
+    TUser* FindUser(const CString& sUser) const {
+        auto it = m_msUsers.find(sUser.AsLower());
+        return it != m_msUsers.end() ? it->second : nullptr;
+    }
+
+    // Takes ownership, false (and pUser deleted) if the name is taken
+    bool AddUser(TUser* pUser) {
+        CString sKey = pUser->GetUsername().AsLower();
+        if (m_msUsers.count(sKey)) {
+            delete pUser;
+            return false;
+        }
+
+        m_msUsers[sKey] = pUser;
+        Reindex();
+        return true;
+    }
+
+    bool DelUser(const CString& sUser) {
+        auto it = m_msUsers.find(sUser.AsLower());
+        if (it == m_msUsers.end()) return false;
+
+        delete it->second;
+        m_msUsers.erase(it);
+        Reindex();
+        return true;
+    }
+
+    // Must be called after the masks of a user changed
+    void Reindex() {
+        m_Index.Clear();
+        for (const auto& it : m_msUsers) {
+            for (const CString& sMask : it.second->GetHostmaskSet()) {
+                m_Index.Add(sMask, it.second);
+            }
+        }
+        ++m_uGeneration;
+    }
+
+    // Goes up on every Reindex(), for whoever caches lookups
+    unsigned int GetGeneration() const { return m_uGeneration; }
+
+    TUser* Find(const CString& sHostmask,
+                const typename CHostmaskIndex<TUser>::AcceptFunc& fAccept =
+                    nullptr) const {
+        return m_Index.Find(sHostmask, fAccept);
+    }
+
+    std::vector<TUser*> FindEach(
+        const VCString& vsHostmasks,
+        const typename CHostmaskIndex<TUser>::AcceptFunc& fAccept =
+            nullptr) const {
+        return m_Index.FindEach(vsHostmasks, fAccept);
+    }
+
+    const std::map<CString, TUser*>& GetUsers() const { return m_msUsers; }
+    bool empty() const { return m_msUsers.empty(); }
+
+  private:
+    std::map<CString, TUser*> m_msUsers;
+    CHostmaskIndex<TUser> m_Index;
+    unsigned int m_uGeneration = 0;
+};
+
+#endif  // !ZNC_HOSTMASK_H
@@ -1,7 +1,6 @@
 // invite.cpp
 
 // TODO:
-//    Add checks to see if people included the nick.
 //    Way to add/remove people without having to connect into znc.
 
 /*
@@ -24,74 +23,38 @@
 #include <znc/IRCNetwork.h>
 #include <znc/Modules.h>
 
+#include <deque>
+
+#include "hostmask.h"
+#include "tokenbucket.h"
+
+// !invite's one user may ask for: 3 at once, then one per 20 seconds
+#define USER_BURST 3
+#define USER_RATE 0.05
+// The same for each channel, whoever asks
+#define CHAN_BURST 5
+#define CHAN_RATE 0.1
+// INVITEs we send: 2 at once, then one every 2 seconds
+#define SEND_BURST 2
+#define SEND_RATE 0.5
+// Anything past this many queued INVITEs is dropped
+#define SEND_QUEUE 20
+
 using std::map;
 using std::set;
 using std::vector;
 
 class CinviteMod;
 
-class CinviteUser {
+class CinviteTimer : public CTimer {
   public:
-    CinviteUser() {}
-
-    CinviteUser(const CString& sLine) { FromString(sLine); }
-
-    CinviteUser(const CString& sUsername, const CString& sHostmasks)
-        : m_sUsername(sUsername) {
-        AddHostmasks(sHostmasks);
-    }
-
-    virtual ~CinviteUser() {}
-
-    const CString& GetUsername() const { return m_sUsername; }
-
-    bool HostMatches(const CString& sHostmask) {
-        for (const CString& s : m_ssHostmasks) {
-            if (sHostmask.WildCmp(s, CString::CaseInsensitive)) {
-                return true;
-            }
-        }
-        return false;
-    }
-
-    CString GetHostmasks() const {
-        return CString(",").Join(m_ssHostmasks.begin(), m_ssHostmasks.end());
-    }
-
-    bool DelHostmasks(const CString& sHostmasks) {
-        VCString vsHostmasks;
-        sHostmasks.Split(",", vsHostmasks);
-
-        for (const CString& s : vsHostmasks) {
-            m_ssHostmasks.erase(s);
-        }
-
-        return m_ssHostmasks.empty();
-    }
-
-    void AddHostmasks(const CString& sHostmasks) {
-        VCString vsHostmasks;
-        sHostmasks.Split(",", vsHostmasks);
-
-        for (const CString& s : vsHostmasks) {
-            m_ssHostmasks.insert(s);
-        }
-    }
-
-    CString ToString() const {
-        return m_sUsername + "\t" + GetHostmasks();
-    }
+    CinviteTimer(CinviteMod* pMod);
+    ~CinviteTimer() override {}
 
-    bool FromString(const CString& sLine) {
-        m_sUsername = sLine.Token(0, false, "\t");
-        sLine.Token(1, false, "\t").Split(",", m_ssHostmasks);
-        return true;
-    }
+    void RunJob() override;
 
   private:
-  protected:
-    CString m_sUsername;
-    set<CString> m_ssHostmasks;
+    CinviteMod* m_pMod;
 };
 
 class CinviteMod : public CModule {
@@ -106,39 +69,81 @@ class CinviteMod : public CModule {
     }
 
     bool OnLoad(const CString& sArgs, CString& sMessage) override {
-        // Load the users
-        for (MCString::iterator it = BeginNV(); it != EndNV(); ++it) {
-            const CString& sLine = it->second;
-            CinviteUser* pUser = new CinviteUser;
-
-            if (!pUser->FromString(sLine) ||
-                FindUser(pUser->GetUsername().AsLower())) {
-                delete pUser;
-            } else {
-                m_msUsers[pUser->GetUsername().AsLower()] = pUser;
+        m_Users.Load(this);
+
+        return true;
+    }
+
+    virtual EModRet OnChanMsg(CNick& Nick, CChan& Channel, CString& sMessage) override {
+        if ((sMessage.Token(0).StripControls() == "!invite") && (Channel.HasPerm(CChan::Op))) {
+            CHostmaskUser* pUser = m_Users.Find(Nick.GetHostMask());
+            if (pUser) {
+                Invite(pUser, sMessage.Token(1).StripControls(), Channel);
             }
         }
+        return CONTINUE;
+    }
 
-        return true;
+    void OnIRCDisconnected() override {
+        m_dInvites.clear();
+        StopTimer();
     }
 
-    ~CinviteMod() override {
-        for (const auto& it : m_msUsers) {
-            delete it.second;
+    // Queues an INVITE unless it's pointless or someone is asking too often
+    void Invite(CHostmaskUser* pUser, const CString& sNick, CChan& Channel) {
+        if (sNick.empty() || Channel.FindNick(sNick)) return;
+
+        for (const SInvite& Queued : m_dInvites) {
+            if (Queued.sNick.Equals(sNick) &&
+                Queued.sChan.Equals(Channel.GetName())) {
+                return;
+            }
         }
-        m_msUsers.clear();
+
+        if (m_dInvites.size() >= SEND_QUEUE) return;
+
+        CTokenBucket& UserBucket = GetBucket(
+            m_mUserBuckets, pUser->GetUsername(), USER_BURST, USER_RATE);
+        CTokenBucket& ChanBucket = GetBucket(
+            m_mChanBuckets, Channel.GetName(), CHAN_BURST, CHAN_RATE);
+        if (!UserBucket.Ready() || !ChanBucket.Ready()) return;
+
+        UserBucket.Take();
+        ChanBucket.Take();
+        m_dInvites.push_back({sNick, Channel.GetName()});
+        SendInvites();
     }
 
-    virtual EModRet OnChanMsg(CNick& Nick, CChan& Channel, CString& sMessage) override {
-        if ((sMessage.Token(0).StripControls() == "!invite") && (Channel.HasPerm(CChan::Op))) {
-            for (const auto& it : m_msUsers) {
-                if (it.second->HostMatches(Nick.GetHostMask())) {
-                    PutIRC("INVITE " + sMessage.Token(1).StripControls() + " " + Channel.GetName());
-                    break;
-                }
+    // Sends what the outgoing bucket allows, the timer takes care of the rest
+    void SendInvites() {
+        while (!m_dInvites.empty() && m_SendBucket.Ready()) {
+            SInvite Queued = m_dInvites.front();
+            m_dInvites.pop_front();
+
+            // Things may have changed while this was queued
+            CChan* pChan = GetNetwork()->FindChan(Queued.sChan);
+            if (!pChan || !pChan->HasPerm(CChan::Op) ||
+                pChan->FindNick(Queued.sNick)) {
+                continue;
             }
+
+            m_SendBucket.Take();
+            PutIRC("INVITE " + Queued.sNick + " " + Queued.sChan);
         }
-        return CONTINUE;
+
+        if (m_dInvites.empty()) {
+            StopTimer();
+        } else if (!m_pTimer) {
+            m_pTimer = new CinviteTimer(this);
+            AddTimer(m_pTimer);
+        }
+    }
+
+    void StopTimer() {
+        if (!m_pTimer) return;
+
+        m_pTimer->Stop();
+        m_pTimer = nullptr;
     }
 
     void OnModCommand(const CString& sLine) override {
@@ -153,10 +158,10 @@ class CinviteMod : public CModule {
         if (sHost.empty()) {
             PutModule("Usage: AddUser <user> <hostmask>[,<hostmasks>...]");
         } else {
-            CinviteUser* pUser = AddUser(sUser, sHost);
+            CHostmaskUser* pUser = AddUser(sUser, sHost);
 
             if (pUser) {
-                SetNV(sUser, pUser->ToString());
+                m_Users.Save(this, pUser);
             }
         }
     }
@@ -173,7 +178,7 @@ class CinviteMod : public CModule {
     }
 
     void OnListUsersCommand(const CString& sLine) {
-        if (m_msUsers.empty()) {
+        if (m_Users.empty()) {
             PutModule("There are no users defined");
             return;
         }
@@ -183,7 +188,7 @@ class CinviteMod : public CModule {
         Table.AddColumn("User");
         Table.AddColumn("Hostmasks");
 
-        for (const auto& it : m_msUsers) {
+        for (const auto& it : m_Users.GetUsers()) {
             VCString vsHostmasks;
             it.second->GetHostmasks().Split(",", vsHostmasks);
             for (unsigned int a = 0; a < vsHostmasks.size(); a++) {
@@ -211,7 +216,7 @@ class CinviteMod : public CModule {
             return;
         }
 
-        CinviteUser* pUser = FindUser(sUser);
+        CHostmaskUser* pUser = FindUser(sUser);
 
         if (!pUser) {
             PutModule("No such user");
@@ -219,8 +224,9 @@ class CinviteMod : public CModule {
         }
 
         pUser->AddHostmasks(sHostmasks);
+        m_Users.Reindex();
         PutModule("Hostmasks(s) added to user [" + pUser->GetUsername() + "]");
-        SetNV(pUser->GetUsername(), pUser->ToString());
+        m_Users.Save(this, pUser);
     }
 
     void OnDelMasksCommand(const CString& sLine) {
@@ -232,7 +238,7 @@ class CinviteMod : public CModule {
             return;
         }
 
-        CinviteUser* pUser = FindUser(sUser);
+        CHostmaskUser* pUser = FindUser(sUser);
 
         if (!pUser) {
             PutModule("No such user");
@@ -244,59 +250,73 @@ class CinviteMod : public CModule {
             DelUser(sUser);
             DelNV(sUser);
         } else {
+            m_Users.Reindex();
             PutModule("Hostmasks(s) Removed from user [" + pUser->GetUsername() + "]");
-            SetNV(pUser->GetUsername(), pUser->ToString());
+            m_Users.Save(this, pUser);
         }
     }
 
-    CinviteUser* FindUser(const CString& sUser) {
-        map<CString, CinviteUser*>::iterator it =
-            m_msUsers.find(sUser.AsLower());
-
-        return (it != m_msUsers.end()) ? it->second : nullptr;
+    CHostmaskUser* FindUser(const CString& sUser) {
+        return m_Users.FindUser(sUser);
     }
 
-    CinviteUser* FindUserByHost(const CString& sHostmask) {
-        for (const auto& it : m_msUsers) {
-            CinviteUser* pUser = it.second;
-            if (pUser->HostMatches(sHostmask)) {
-                return pUser;
-            }
-        }
-
-        return nullptr;
+    CHostmaskUser* FindUserByHost(const CString& sHostmask) {
+        return m_Users.Find(sHostmask);
     }
 
     void DelUser(const CString& sUser) {
-        map<CString, CinviteUser*>::iterator it =
-            m_msUsers.find(sUser.AsLower());
-
-        if (it == m_msUsers.end()) {
+        if (!m_Users.DelUser(sUser)) {
             PutModule("That user does not exist");
             return;
         }
 
-        delete it->second;
-        m_msUsers.erase(it);
         PutModule("User [" + sUser + "] removed");
     }
 
-    CinviteUser* AddUser(const CString& sUser, const CString& sHosts) {
-        if (m_msUsers.find(sUser) != m_msUsers.end()) {
+    CHostmaskUser* AddUser(const CString& sUser, const CString& sHosts) {
+        CHostmaskUser* pUser = new CHostmaskUser(sUser, sHosts);
+        if (!m_Users.AddUser(pUser)) {
             PutModule("That user already exists");
             return nullptr;
         }
 
-        CinviteUser* pUser = new CinviteUser(sUser, sHosts);
-        m_msUsers[sUser.AsLower()] = pUser;
         PutModule("User [" + sUser + "] added with hostmask(s) [" + sHosts + "]");
         return pUser;
     }
 
   private:
-    map<CString, CinviteUser*> m_msUsers;
+    static CTokenBucket& GetBucket(map<CString, CTokenBucket>& mBuckets,
+                                   const CString& sKey, double dBurst,
+                                   double dRate) {
+        auto it = mBuckets.find(sKey.AsLower());
+        if (it == mBuckets.end()) {
+            it = mBuckets.emplace(sKey.AsLower(), CTokenBucket(dBurst, dRate))
+                     .first;
+        }
+        return it->second;
+    }
+
+    struct SInvite {
+        CString sNick;
+        CString sChan;
+    };
+
+    CHostmaskUsers<CHostmaskUser> m_Users;
+    // By lower case username and channel name
+    map<CString, CTokenBucket> m_mUserBuckets;
+    map<CString, CTokenBucket> m_mChanBuckets;
+    CTokenBucket m_SendBucket{SEND_BURST, SEND_RATE};
+    std::deque<SInvite> m_dInvites;
+    CinviteTimer* m_pTimer = nullptr;
 };
 
+CinviteTimer::CinviteTimer(CinviteMod* pMod)
+    : CTimer(pMod, 1, 0, "InviteTimer", "Sends queued INVITEs") {
+    m_pMod = pMod;
+}
+
+void CinviteTimer::RunJob() { m_pMod->SendInvites(); }
+
 template <>
 void TModInfo<CinviteMod>(CModInfo& Info) {
     //    Info.SetWikiPage("invite");
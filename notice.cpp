@@ -25,76 +25,19 @@
 #include <znc/Modules.h>
 #include <znc/User.h>
 
+#include <unordered_map>
+
+#include "hostmask.h"
+
+// How many hostmasks we remember a verdict for
+#define VERDICT_CACHE 1024
+
 using std::map;
 using std::set;
 using std::vector;
 
 class CnoticeMod;
 
-class CnoticeUser {
-  public:
-    CnoticeUser() {}
-
-    CnoticeUser(const CString& sLine) { FromString(sLine); }
-
-    CnoticeUser(const CString& sUsername, const CString& sHostmasks)
-        : m_sUsername(sUsername) {
-        AddHostmasks(sHostmasks);
-    }
-
-    virtual ~CnoticeUser() {}
-
-    const CString& GetUsername() const { return m_sUsername; }
-
-    bool HostMatches(const CString& sHostmask) {
-        for (const CString& s : m_ssHostmasks) {
-            if (sHostmask.WildCmp(s, CString::CaseInsensitive)) {
-                return true;
-            }
-        }
-        return false;
-    }
-
-    CString GetHostmasks() const {
-        return CString(",").Join(m_ssHostmasks.begin(), m_ssHostmasks.end());
-    }
-
-    bool DelHostmasks(const CString& sHostmasks) {
-        VCString vsHostmasks;
-        sHostmasks.Split(",", vsHostmasks);
-
-        for (const CString& s : vsHostmasks) {
-            m_ssHostmasks.erase(s);
-        }
-
-        return m_ssHostmasks.empty();
-    }
-
-    void AddHostmasks(const CString& sHostmasks) {
-        VCString vsHostmasks;
-        sHostmasks.Split(",", vsHostmasks);
-
-        for (const CString& s : vsHostmasks) {
-            m_ssHostmasks.insert(s);
-        }
-    }
-
-    CString ToString() const {
-        return m_sUsername + "\t" + GetHostmasks();
-    }
-
-    bool FromString(const CString& sLine) {
-        m_sUsername = sLine.Token(0, false, "\t");
-        sLine.Token(1, false, "\t").Split(",", m_ssHostmasks);
-        return true;
-    }
-
-  private:
-  protected:
-    CString m_sUsername;
-    set<CString> m_ssHostmasks;
-};
-
 class CnoticeMod : public CModule {
   public:
     MODCONSTRUCTOR(CnoticeMod) {
@@ -107,38 +50,36 @@ class CnoticeMod : public CModule {
     }
 
     bool OnLoad(const CString& sArgs, CString& sMessage) override {
-        // Load the users
-        for (MCString::iterator it = BeginNV(); it != EndNV(); ++it) {
-            const CString& sLine = it->second;
-            CnoticeUser* pUser = new CnoticeUser;
-
-            if (!pUser->FromString(sLine) ||
-                FindUser(pUser->GetUsername().AsLower())) {
-                delete pUser;
-            } else {
-                m_msUsers[pUser->GetUsername().AsLower()] = pUser;
-            }
-        }
+        m_Users.Load(this);
 
         return true;
     }
 
-    ~CnoticeMod() override {
-        for (const auto& it : m_msUsers) {
-            delete it.second;
+    // Services and servers send the same few hostmasks over and over, so
+    // remember what the index said about them, nullptr included
+    CHostmaskUser* FindCached(const CString& sHostmask) {
+        if (m_uVerdictsGen != m_Users.GetGeneration()) {
+            m_mVerdicts.clear();
+            m_uVerdictsGen = m_Users.GetGeneration();
         }
-        m_msUsers.clear();
+
+        auto it = m_mVerdicts.find(sHostmask);
+        if (it != m_mVerdicts.end()) return it->second;
+
+        if (m_mVerdicts.size() >= VERDICT_CACHE) m_mVerdicts.clear();
+
+        CHostmaskUser* pUser = m_Users.Find(sHostmask);
+        m_mVerdicts[sHostmask] = pUser;
+        return pUser;
     }
 
     virtual EModRet OnPrivNoticeMessage(CNoticeMessage& Message) override {
         const CNick& Nick = Message.GetNick();
         CString sMessage = Message.GetText();
 
-        for (const auto& it : m_msUsers) {
-            if (it.second->HostMatches(Nick.GetNickMask())) {
-                PutUser(":" + Nick.GetNickMask() + " PRIVMSG " + GetUser()->GetNick() + " :" + sMessage);
-                return HALTCORE;  // Block original NOTICE since we converted it
-            }
+        if (FindCached(Nick.GetNickMask())) {
+            PutUser(":" + Nick.GetNickMask() + " PRIVMSG " + GetUser()->GetNick() + " :" + sMessage);
+            return HALTCORE;  // Block original NOTICE since we converted it
         }
         return CONTINUE;  // Allow original NOTICE to pass through
     }
@@ -155,10 +96,10 @@ class CnoticeMod : public CModule {
         if (sHost.empty()) {
             PutModule("Usage: AddUser <user> <hostmask>[,<hostmasks>...]");
         } else {
-            CnoticeUser* pUser = AddUser(sUser, sHost);
+            CHostmaskUser* pUser = AddUser(sUser, sHost);
 
             if (pUser) {
-                SetNV(sUser, pUser->ToString());
+                m_Users.Save(this, pUser);
             }
         }
     }
@@ -175,7 +116,7 @@ class CnoticeMod : public CModule {
     }
 
     void OnListUsersCommand(const CString& sLine) {
-        if (m_msUsers.empty()) {
+        if (m_Users.empty()) {
             PutModule("There are no users defined");
             return;
         }
@@ -185,7 +126,7 @@ class CnoticeMod : public CModule {
         Table.AddColumn("User");
         Table.AddColumn("Hostmasks");
 
-        for (const auto& it : m_msUsers) {
+        for (const auto& it : m_Users.GetUsers()) {
             VCString vsHostmasks;
             it.second->GetHostmasks().Split(",", vsHostmasks);
             for (unsigned int a = 0; a < vsHostmasks.size(); a++) {
@@ -213,7 +154,7 @@ class CnoticeMod : public CModule {
             return;
         }
 
-        CnoticeUser* pUser = FindUser(sUser);
+        CHostmaskUser* pUser = FindUser(sUser);
 
         if (!pUser) {
             PutModule("No such user");
@@ -221,8 +162,9 @@ class CnoticeMod : public CModule {
         }
 
         pUser->AddHostmasks(sHostmasks);
+        m_Users.Reindex();
         PutModule("Hostmasks(s) added to user [" + pUser->GetUsername() + "]");
-        SetNV(pUser->GetUsername(), pUser->ToString());
+        m_Users.Save(this, pUser);
     }
 
     void OnDelMasksCommand(const CString& sLine) {
@@ -234,7 +176,7 @@ class CnoticeMod : public CModule {
             return;
         }
 
-        CnoticeUser* pUser = FindUser(sUser);
+        CHostmaskUser* pUser = FindUser(sUser);
 
         if (!pUser) {
             PutModule("No such user");
@@ -246,57 +188,46 @@ class CnoticeMod : public CModule {
             DelUser(sUser);
             DelNV(sUser);
         } else {
+            m_Users.Reindex();
             PutModule("Hostmasks(s) Removed from user [" + pUser->GetUsername() + "]");
-            SetNV(pUser->GetUsername(), pUser->ToString());
+            m_Users.Save(this, pUser);
         }
     }
 
-    CnoticeUser* FindUser(const CString& sUser) {
-        map<CString, CnoticeUser*>::iterator it =
-            m_msUsers.find(sUser.AsLower());
-
-        return (it != m_msUsers.end()) ? it->second : nullptr;
+    CHostmaskUser* FindUser(const CString& sUser) {
+        return m_Users.FindUser(sUser);
     }
 
-    CnoticeUser* FindUserByHost(const CString& sHostmask) {
-        for (const auto& it : m_msUsers) {
-            CnoticeUser* pUser = it.second;
-            if (pUser->HostMatches(sHostmask)) {
-                return pUser;
-            }
-        }
-
-        return nullptr;
+    CHostmaskUser* FindUserByHost(const CString& sHostmask) {
+        return m_Users.Find(sHostmask);
     }
 
     void DelUser(const CString& sUser) {
-        map<CString, CnoticeUser*>::iterator it =
-            m_msUsers.find(sUser.AsLower());
-
-        if (it == m_msUsers.end()) {
+        if (!m_Users.DelUser(sUser)) {
             PutModule("That user does not exist");
             return;
         }
 
-        delete it->second;
-        m_msUsers.erase(it);
         PutModule("User [" + sUser + "] removed");
     }
 
-    CnoticeUser* AddUser(const CString& sUser, const CString& sHosts) {
-        if (m_msUsers.find(sUser) != m_msUsers.end()) {
+    CHostmaskUser* AddUser(const CString& sUser, const CString& sHosts) {
+        CHostmaskUser* pUser = new CHostmaskUser(sUser, sHosts);
+        if (!m_Users.AddUser(pUser)) {
             PutModule("That user already exists");
             return nullptr;
         }
 
-        CnoticeUser* pUser = new CnoticeUser(sUser, sHosts);
-        m_msUsers[sUser.AsLower()] = pUser;
         PutModule("User [" + sUser + "] added with hostmask(s) [" + sHosts + "]");
         return pUser;
     }
 
   private:
-    map<CString, CnoticeUser*> m_msUsers;
+    CHostmaskUsers<CHostmaskUser> m_Users;
+    // Hostmask as sent by the server to the user it matched, if any
+    std::unordered_map<std::string, CHostmaskUser*> m_mVerdicts;
+    // What m_Users.GetGeneration() was when m_mVerdicts was filled
+    unsigned int m_uVerdictsGen = 0;
 };
 
 template <>
@@ -2,8 +2,8 @@
 //
 // Original partyline would put the partyline channels into all your networks.
 // This modified version lets you pick use one (or more) networks you want to use.
-// The /msg ?NICK ... is still sent to all network connections... I'll work on
-//    that later... maybe.
+// The /msg ?NICK ... only goes to the networks the recipient has partyline
+//    channels on, see the QueryFallback command for when there are none.
 
 /*
  * Copyright (C) 2004-2026 ZNC, see the NOTICE file for details.
@@ -21,9 +21,14 @@
  * limitations under the License.
  */
 
+#include <znc/FileUtils.h>
 #include <znc/IRCNetwork.h>
 #include <znc/User.h>
 
+#include <sys/time.h>
+#include <deque>
+#include <unordered_map>
+
 using std::map;
 using std::set;
 using std::vector;
@@ -36,6 +41,26 @@ using std::vector;
 #define NICK_PREFIX CString("?")
 #define NICK_PREFIX_C '?'
 
+// Lines of history each channel keeps unless configured otherwise, and the
+// most it may be configured to
+#define HISTORY_LINES 50
+#define HISTORY_MAX 1000
+
+// Users of linked instances show up as ?user|instance
+#define LINK_SEP "|"
+// Bytes waiting in a link's socket before further lines are queued, and
+// queued lines after which a link is considered dead and dropped
+#define LINK_HIGH_WATER (64 * 1024)
+#define LINK_MAX_QUEUE 10000
+// Seconds between pings and reconnect attempts
+#define LINK_INTERVAL 30
+// Version in the LINK line, both ends must speak the same
+#define LINK_PROTO "3"
+// Numbered lines remembered per instance to drop the ones seen already
+#define LINK_SEEN 4096
+// Where LinkListen binds unless told otherwise
+#define LINK_LISTEN_HOST "127.0.0.1"
+
 struct SPartylineUser {
     CString sUsername;
     CIRCNetwork* pNetwork;
@@ -46,6 +71,100 @@ struct SPartylineUser {
     }
 };
 
+// A client that lines sent to a channel are delivered to
+struct SPartylineClient {
+    CUser* pUser;
+    CIRCNetwork* pNetwork;
+    CClient* pClient;
+};
+
+// A line that differs per client only by the nick (or mask) in it. The
+// buffer keeps the prefix and is reused for every recipient.
+class CNickSlotLine {
+  public:
+    CNickSlotLine(const CString& sPre, const CString& sPost)
+        : m_sLine(sPre), m_uPreLen(sPre.size()), m_sPost(sPost) {}
+
+    const CString& For(const CString& sNick) {
+        m_sLine.erase(m_uPreLen);
+        m_sLine.append(sNick).append(m_sPost);
+        return m_sLine;
+    }
+
+  private:
+    CString m_sLine;
+    CString::size_type m_uPreLen;
+    CString m_sPost;
+};
+
+struct SHistoryLine {
+    timeval tv;
+    CString sLine;
+};
+
+// Fixed size ring of the most recent channel messages. Slots are allocated
+// up front and overwritten in place once the ring is full.
+class CPartylineHistory {
+  public:
+    void SetSize(size_t uSize) {
+        vector<SHistoryLine> vLines(uSize);
+        size_t uKeep = std::min(m_uCount, uSize);
+        for (size_t i = 0; i < uKeep; ++i) {
+            vLines[i] = std::move(Line(m_uCount - uKeep + i));
+        }
+
+        m_vLines = std::move(vLines);
+        m_uStart = 0;
+        m_uCount = uKeep;
+    }
+
+    void Add(const timeval& tv, const CString& sLine) {
+        if (m_vLines.empty()) return;
+
+        SHistoryLine& Slot = m_vLines[(m_uStart + m_uCount) % m_vLines.size()];
+        if (m_uCount < m_vLines.size()) {
+            ++m_uCount;
+        } else {
+            m_uStart = (m_uStart + 1) % m_vLines.size();
+        }
+
+        Slot.tv = tv;
+        Slot.sLine = sLine;
+    }
+
+    // Oldest line first
+    SHistoryLine& Line(size_t i) {
+        return m_vLines[(m_uStart + i) % m_vLines.size()];
+    }
+    const SHistoryLine& Line(size_t i) const {
+        return m_vLines[(m_uStart + i) % m_vLines.size()];
+    }
+
+    size_t size() const { return m_uCount; }
+    bool empty() const { return m_uCount == 0; }
+
+  private:
+    vector<SHistoryLine> m_vLines;
+    size_t m_uStart = 0;
+    size_t m_uCount = 0;
+};
+
+// Channel names are case insensitive, hash and compare them without having
+// to build a lowercase copy for every lookup
+struct SChanNameHash {
+    size_t operator()(const CString& sName) const {
+        size_t uHash = 0;
+        for (unsigned char c : sName) uHash = uHash * 31 + tolower(c);
+        return uHash;
+    }
+};
+
+struct SChanNameEqual {
+    bool operator()(const CString& a, const CString& b) const {
+        return a.Equals(b);
+    }
+};
+
 class CPartylineChannel {
   public:
     CPartylineChannel(const CString& sName) { m_sName = sName.AsLower(); }
@@ -55,15 +174,27 @@ class CPartylineChannel {
     const CString& GetName() const { return m_sName; }
 
     const set<SPartylineUser>& GetUsers() const { return m_ssUsers; }
+    CPartylineHistory& GetHistory() { return m_History; }
 
     void SetTopic(const CString& s) { m_sTopic = s; }
 
     void AddUser(const CString& sUsername, CIRCNetwork* pNetwork) {
         m_ssUsers.insert({sUsername, pNetwork});
+        m_uClientsGen = 0;
     }
 
     void DelUser(const CString& sUsername, CIRCNetwork* pNetwork) {
         m_ssUsers.erase({sUsername, pNetwork});
+        m_uClientsGen = 0;
+    }
+
+    // Cached fan-out list, valid while uGen matches the module's generation
+    bool HasClients(unsigned int uGen) const { return m_uClientsGen == uGen; }
+    const vector<SPartylineClient>& GetClients() const { return m_vClients; }
+
+    void SetClients(vector<SPartylineClient>&& vClients, unsigned int uGen) {
+        m_vClients = std::move(vClients);
+        m_uClientsGen = uGen;
     }
 
     bool IsInChannel(const CString& sUsername, CIRCNetwork* pNetwork) {
@@ -85,12 +216,86 @@ class CPartylineChannel {
     CString m_sTopic;
     CString m_sName;
     set<SPartylineUser> m_ssUsers;
+    CPartylineHistory m_History;
+    vector<SPartylineClient> m_vClients;
+    unsigned int m_uClientsGen = 0;
+};
+
+class CPartylineMod;
+
+// A connection to another ZNC instance running partyline. Both ends send
+// "LINK 3 <name> <password>", then a burst of their channel members and
+// topics ended by "BURST", then JOIN/PART/TOPIC/MSG lines as things happen.
+// Every line after LINK but PING and PONG starts with "@<instance>|<number>",
+// naming the instance it started on, so that each instance handles it once.
+// JOIN ends in "@" for users that are admins on their own instance, only
+// they may set topics. A linked instance is trusted to tell the truth here.
+class CPartylineLink : public CSocket {
+  public:
+    // sPeer is the instance we expect on the other end, empty when accepted
+    CPartylineLink(CPartylineMod* pMod, const CString& sPeer);
+    ~CPartylineLink() override {}
+
+    void Connected() override;
+    void Disconnected() override;
+    void ConnectionRefused() override;
+    void Timeout() override;
+    void SockError(int iErrno, const CString& sDescription) override;
+    void ReadLine(const CString& sLine) override;
+
+    // Lines are written straight away unless the peer is not keeping up,
+    // then they wait in the queue and go out in batches from Flush()
+    void Send(const CString& sLine);
+    void Flush();
+
+    const CString& GetPeer() const { return m_sPeer; }
+    void SetPeer(const CString& sPeer) { m_sPeer = sPeer; }
+    bool IsOutgoing() const { return m_bOutgoing; }
+    bool IsLinked() const { return m_bLinked; }
+    void SetLinked(bool b) { m_bLinked = b; }
+    size_t GetQueueSize() const { return m_dQueue.size(); }
+
+    // Channel and user of every member this link told us about
+    set<std::pair<CString, CString>>& GetMembers() { return m_ssMembers; }
+    // The members that joined as admins of their instance
+    set<std::pair<CString, CString>>& GetAdmins() { return m_ssAdmins; }
+
+  private:
+    CPartylineMod* m_pMod;
+    CString m_sPeer;
+    bool m_bOutgoing;
+    bool m_bLinked = false;
+    std::deque<CString> m_dQueue;
+    set<std::pair<CString, CString>> m_ssMembers;
+    set<std::pair<CString, CString>> m_ssAdmins;
+};
+
+class CPartylineListener : public CSocket {
+  public:
+    CPartylineListener(CPartylineMod* pMod);
+    ~CPartylineListener() override {}
+
+    Csock* GetSockObj(const CString& sHost, unsigned short uPort) override;
+
+  private:
+    CPartylineMod* m_pMod;
+};
+
+class CPartylineTimer : public CTimer {
+  public:
+    CPartylineTimer(CPartylineMod* pMod);
+    ~CPartylineTimer() override {}
+
+    void RunJob() override;
+
+  private:
+    CPartylineMod* m_pMod;
 };
 
 class CPartylineMod : public CModule {
   public:
     void ListChannelsCommand(const CString& sLine) {
-        if (m_ssChannels.empty()) {
+        if (m_msChannels.empty()) {
             PutModule(t_s("There are no open channels."));
             return;
         }
@@ -100,54 +305,253 @@ class CPartylineMod : public CModule {
         Table.AddColumn(t_s("Channel"));
         Table.AddColumn(t_s("Users"));
 
-        for (set<CPartylineChannel*>::const_iterator a = m_ssChannels.begin();
-             a != m_ssChannels.end(); ++a) {
+        for (const auto& it : m_msChannels) {
             Table.AddRow();
 
-            Table.SetCell(t_s("Channel"), (*a)->GetName());
-            Table.SetCell(t_s("Users"), CString((*a)->GetUsers().size()));
+            Table.SetCell(t_s("Channel"), it.second->GetName());
+            Table.SetCell(t_s("Users"), CString(it.second->GetUsers().size()));
         }
 
         PutModule(Table);
     }
 
+    void HistoryCommand(const CString& sLine) {
+        if (!CheckAdmin()) return;
+        CString sLines = sLine.Token(1);
+
+        if (!sLines.empty()) {
+            m_uHistoryLines =
+                std::min(sLines.ToUInt(), (unsigned int)HISTORY_MAX);
+            SetNV("history:lines", CString(m_uHistoryLines));
+
+            for (const auto& it : m_msChannels) {
+                it.second->GetHistory().SetSize(m_uHistoryLines);
+            }
+            for (auto& it : m_mSavedHistory) {
+                it.second.SetSize(m_uHistoryLines);
+            }
+        }
+
+        PutModule(t_f("Channels replay up to {1} lines on join")(
+            m_uHistoryLines));
+    }
+
+    void SaveHistoryCommand(const CString& sLine) {
+        if (!CheckAdmin()) return;
+        CString sSave = sLine.Token(1);
+
+        if (!sSave.empty()) {
+            m_bSaveHistory = sSave.ToBool();
+            SetNV("history:save", CString(m_bSaveHistory));
+
+            if (m_bSaveHistory) {
+                SaveHistory();
+            } else {
+                m_mSavedHistory.clear();
+                CFile::Delete(HistoryFile());
+            }
+        }
+
+        if (m_bSaveHistory) {
+            PutModule(t_s("History is kept across restarts"));
+        } else {
+            PutModule(t_s("History is lost on restart"));
+        }
+    }
+
+    void QueryFallbackCommand(const CString& sLine) {
+        if (!CheckAdmin()) return;
+        CString sFallback = sLine.Token(1);
+
+        if (sFallback.Equals("all")) {
+            m_bQueryAll = true;
+        } else if (sFallback.Equals("none")) {
+            m_bQueryAll = false;
+        } else if (!sFallback.empty()) {
+            PutModule(t_s("Usage: QueryFallback [all|none]"));
+            return;
+        }
+        SetNV("query:fallback", m_bQueryAll ? "all" : "none");
+
+        if (m_bQueryAll) {
+            PutModule(t_s("Queries to users not on the partyline go to all "
+                          "their clients"));
+        } else {
+            PutModule(t_s("Queries to users not on the partyline are refused"));
+        }
+    }
+
+    bool CheckAdmin() {
+        if (GetUser()->IsAdmin()) return true;
+        PutModule(t_s("Access denied"));
+        return false;
+    }
+
+    void LinkNameCommand(const CString& sLine) {
+        if (!CheckAdmin()) return;
+        CString sName = sLine.Token(1);
+
+        if (!sName.empty()) {
+            if (sName.find(LINK_SEP) != CString::npos) {
+                PutModule(t_f("The name may not contain {1}")(LINK_SEP));
+                return;
+            }
+            m_sLinkName = sName;
+            SetNV("link:name", m_sLinkName);
+        }
+
+        if (m_sLinkName.empty()) {
+            PutModule(t_s("No name set, linking is disabled"));
+        } else {
+            PutModule(t_f("This instance is linked as {1}")(m_sLinkName));
+        }
+    }
+
+    void LinkListenCommand(const CString& sLine) {
+        if (!CheckAdmin()) return;
+        CString sPort = sLine.Token(1);
+        CString sPass = sLine.Token(2);
+        CString sHost = sLine.Token(3);
+
+        if (sPort.Equals("off")) {
+            DelNV("link:listen");
+            StopListening();
+            PutModule(t_s("No longer accepting links"));
+            return;
+        }
+
+        if (sPort.TrimPrefix_n("+").ToUShort() == 0 || sPass.empty()) {
+            PutModule(t_s(
+                "Usage: LinkListen <[+]port> <password> [host|*] | off"));
+            return;
+        }
+        if (sHost.empty()) sHost = LINK_LISTEN_HOST;
+
+        SetNV("link:listen", sPort + " " + HashLinkPass(sPass) + " " + sHost);
+        if (Listen()) {
+            PutModule(t_f("Accepting links on {1} port {2}")(sHost, sPort));
+        } else {
+            PutModule(t_f("Unable to listen on {1} port {2}")(sHost, sPort));
+        }
+    }
+
+    void LinkAddCommand(const CString& sLine) {
+        if (!CheckAdmin()) return;
+        CString sName = sLine.Token(1);
+        CString sHost = sLine.Token(2);
+        CString sPort = sLine.Token(3);
+        CString sPass = sLine.Token(4);
+
+        if (sName.empty() || sHost.empty() ||
+            sPort.TrimPrefix_n("+").ToUShort() == 0 || sPass.empty()) {
+            PutModule(
+                t_s("Usage: LinkAdd <name> <host> <[+]port> <password>"));
+            return;
+        }
+
+        SetNV("link:peer:" + sName, sHost + " " + sPort + " " + sPass);
+        ConnectLinks();
+        PutModule(t_f("Linking to {1}")(sName));
+    }
+
+    void LinkDelCommand(const CString& sLine) {
+        if (!CheckAdmin()) return;
+        CString sName = sLine.Token(1);
+
+        if (!HasNV("link:peer:" + sName)) {
+            PutModule(t_f("No link named {1}")(sName));
+            return;
+        }
+
+        DelNV("link:peer:" + sName);
+        CPartylineLink* pLink = FindLink(sName);
+        if (pLink) pLink->Close(Csock::CLT_AFTERWRITE);
+        PutModule(t_f("Removed link {1}")(sName));
+    }
+
+    void LinksCommand(const CString& sLine) {
+        if (!CheckAdmin()) return;
+        CTable Table;
+        Table.AddColumn(t_s("Name"));
+        Table.AddColumn(t_s("Direction"));
+        Table.AddColumn(t_s("State"));
+        Table.AddColumn(t_s("Members"));
+        Table.AddColumn(t_s("Queued"));
+
+        for (CPartylineLink* pLink : GetLinks()) {
+            Table.AddRow();
+            Table.SetCell(t_s("Name"), pLink->GetPeer().empty()
+                                           ? pLink->GetRemoteIP()
+                                           : pLink->GetPeer());
+            Table.SetCell(t_s("Direction"),
+                          pLink->IsOutgoing() ? t_s("Out") : t_s("In"));
+            Table.SetCell(t_s("State"), pLink->IsLinked()
+                                            ? t_s("Linked")
+                                            : t_s("Connecting"));
+            Table.SetCell(t_s("Members"), CString(pLink->GetMembers().size()));
+            Table.SetCell(t_s("Queued"), CString(pLink->GetQueueSize()));
+        }
+
+        if (Table.empty()) {
+            PutModule(t_s("No links"));
+        } else {
+            PutModule(Table);
+        }
+    }
+
     MODCONSTRUCTOR(CPartylineMod) {
         AddHelpCommand();
         AddCommand("List", "", t_d("List all open channels"),
                    [=](const CString& sLine) { ListChannelsCommand(sLine); });
+        AddCommand("History", t_d("[lines]"),
+                   t_d("Show or set how many lines each channel replays on "
+                       "join, 0 disables, 1000 at most"),
+                   [=](const CString& sLine) { HistoryCommand(sLine); });
+        AddCommand("QueryFallback", t_d("[all|none]"),
+                   t_d("Show or set where /msg ?nick goes if the recipient "
+                       "has no clients on their partyline networks"),
+                   [=](const CString& sLine) { QueryFallbackCommand(sLine); });
+        AddCommand("SaveHistory", t_d("[yes|no]"),
+                   t_d("Show or set whether history is kept across restarts"),
+                   [=](const CString& sLine) { SaveHistoryCommand(sLine); });
+        AddCommand("LinkName", t_d("[name]"),
+                   t_d("Show or set the name other instances know this one "
+                       "by"),
+                   [=](const CString& sLine) { LinkNameCommand(sLine); });
+        AddCommand("LinkListen", t_d("<[+]port> <password> [host|*] | off"),
+                   t_d("Accept links from other instances, + means SSL. "
+                       "Only local ones unless a host to bind to is given, "
+                       "* binds to all addresses"),
+                   [=](const CString& sLine) { LinkListenCommand(sLine); });
+        AddCommand("LinkAdd", t_d("<name> <host> <[+]port> <password>"),
+                   t_d("Link to another instance and keep reconnecting"),
+                   [=](const CString& sLine) { LinkAddCommand(sLine); });
+        AddCommand("LinkDel", t_d("<name>"), t_d("Remove a link"),
+                   [=](const CString& sLine) { LinkDelCommand(sLine); });
+        AddCommand("Links", "", t_d("List links to other instances"),
+                   [=](const CString& sLine) { LinksCommand(sLine); });
     }
 
     ~CPartylineMod() override {
+        if (m_bSaveHistory) SaveHistory();
+
         // Kick all clients who are in partyline channels
-        for (set<CPartylineChannel*>::iterator it = m_ssChannels.begin();
-             it != m_ssChannels.end(); ++it) {
-            const set<SPartylineUser>& ssUsers = (*it)->GetUsers();
-
-            for (set<SPartylineUser>::const_iterator it2 = ssUsers.begin();
-                 it2 != ssUsers.end(); ++it2) {
-                CUser* pUser = CZNC::Get().FindUser(it2->sUsername);
-                if (!pUser) continue;
-
-                vector<CClient*> vClients = pUser->GetAllClients();
-
-                for (vector<CClient*>::const_iterator it3 = vClients.begin();
-                     it3 != vClients.end(); ++it3) {
-                    CClient* pClient = *it3;
-                    // Only kick clients on the network where the user joined the channel
-                    if (pClient->GetNetwork() == it2->pNetwork) {
-                        pClient->PutClient(":*" + GetModName() +
-                                           "!znc@znc.in KICK " + (*it)->GetName() +
-                                           " " + pClient->GetNick() + " :" +
-                                           GetModName() + " unloaded");
-                    }
-                }
+        for (const auto& it : m_msChannels) {
+            CPartylineChannel* pChannel = it.second;
+
+            CNickSlotLine Kick(":*" + GetModName() + "!znc@znc.in KICK " +
+                                   pChannel->GetName() + " ",
+                               " :" + GetModName() + " unloaded");
+
+            for (const SPartylineClient& Target : GetChanClients(pChannel)) {
+                Target.pClient->PutClient(Kick.For(Target.pClient->GetNick()));
             }
         }
 
-        while (!m_ssChannels.empty()) {
-            delete *m_ssChannels.begin();
-            m_ssChannels.erase(m_ssChannels.begin());
+        for (const auto& it : m_msChannels) {
+            delete it.second;
         }
+        m_msChannels.clear();
     }
 
     bool OnBoot() override {
@@ -186,11 +590,134 @@ class CPartylineMod : public CModule {
             }
         }
 
+        if (HasNV("history:lines")) {
+            m_uHistoryLines = std::min(GetNV("history:lines").ToUInt(),
+                                       (unsigned int)HISTORY_MAX);
+        }
+        m_bSaveHistory = GetNV("history:save").ToBool();
+        m_bQueryAll = !GetNV("query:fallback").Equals("none");
+        m_sLinkName = GetNV("link:name");
+        if (m_bSaveHistory) LoadHistory();
+
+        // Older versions saved the listen password in plain text
+        CString sListen = GetNV("link:listen");
+        if (!sListen.empty() && !IsLinkPassHash(sListen.Token(1))) {
+            SetNV("link:listen", sListen.Token(0) + " " +
+                                     HashLinkPass(sListen.Token(1)) + " " +
+                                     sListen.Token(2, true));
+        }
+
+        // Numbers this instance gives its lines go on growing after a
+        // restart, so others don't take new lines for ones they have seen
+        timeval tv;
+        gettimeofday(&tv, nullptr);
+        m_uLinkSeq = (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+
         Load();
 
+        Listen();
+        ConnectLinks();
+        AddTimer(new CPartylineTimer(this));
+
         return true;
     }
 
+    CString HistoryFile() const { return GetSavePath() + "/history"; }
+
+    // Lines are "channel\tseconds\tmicroseconds\tline", oldest first
+    void LoadHistory() {
+        CFile History(HistoryFile());
+        if (!History.Open()) return;
+
+        CString sLine;
+        while (History.ReadLine(sLine)) {
+            sLine.TrimRight("\r\n");
+            CString sChan = sLine.Token(0, false, "\t");
+            CString sText = sLine.Token(3, true, "\t");
+            if (sChan.empty() || sText.empty()) continue;
+
+            timeval tv;
+            tv.tv_sec = (time_t)sLine.Token(1, false, "\t").ToLongLong();
+            tv.tv_usec = sLine.Token(2, false, "\t").ToLong();
+
+            GetSavedHistory(sChan.AsLower()).Add(tv, sText);
+        }
+        History.Close();
+    }
+
+    CPartylineHistory& GetSavedHistory(const CString& sChan) {
+        auto it = m_mSavedHistory.find(sChan);
+        if (it == m_mSavedHistory.end()) {
+            it = m_mSavedHistory.emplace(sChan, CPartylineHistory()).first;
+            it->second.SetSize(m_uHistoryLines);
+        }
+        return it->second;
+    }
+
+    void SaveHistory() {
+        CString sTmp = HistoryFile() + ".tmp";
+
+        CFile History(sTmp);
+        if (!History.Open(O_WRONLY | O_CREAT | O_TRUNC, 0600)) {
+            DEBUG("partyline: unable to write [" << sTmp << "]");
+            return;
+        }
+
+        auto Write = [&](const CString& sChan, CPartylineHistory& Hist) {
+            for (size_t i = 0; i < Hist.size(); ++i) {
+                const SHistoryLine& Line = Hist.Line(i);
+                History.Write(sChan + "\t" + CString(Line.tv.tv_sec) + "\t" +
+                              CString(Line.tv.tv_usec) + "\t" + Line.sLine +
+                              "\n");
+            }
+        };
+
+        for (const auto& it : m_msChannels) {
+            Write(it.second->GetName(), it.second->GetHistory());
+        }
+        for (auto& it : m_mSavedHistory) {
+            Write(it.first, it.second);
+        }
+        History.Close();
+
+        CFile::Move(sTmp, HistoryFile(), true);
+    }
+
+    // Sends the channel's recent messages to a client that just joined it,
+    // wrapped in a batch and with their original times where supported
+    void ReplayHistory(CClient* pClient, CPartylineChannel* pChannel) {
+        const CPartylineHistory& Hist = pChannel->GetHistory();
+        if (Hist.empty()) return;
+
+        bool bBatch = pClient->HasBatch();
+        bool bTime = pClient->HasServerTime();
+        CString sBatch = pChannel->GetName().MD5();
+
+        if (bBatch) {
+            pClient->PutClient(":znc.in BATCH +" + sBatch +
+                               " znc.in/playback " + pChannel->GetName());
+        }
+
+        for (size_t i = 0; i < Hist.size(); ++i) {
+            const SHistoryLine& Line = Hist.Line(i);
+
+            CString sTags;
+            if (bBatch) sTags = "batch=" + sBatch;
+            if (bTime) {
+                if (!sTags.empty()) sTags += ";";
+                sTags += "time=" + CUtils::FormatServerTime(Line.tv);
+            }
+
+            if (sTags.empty()) {
+                pClient->PutClient(Line.sLine);
+            } else {
+                pClient->PutClient("@" + sTags + " " + Line.sLine);
+            }
+        }
+
+        if (bBatch) pClient->PutClient(":znc.in BATCH -" + sBatch);
+    }
+
     void Load() {
         CString sAction, sKey;
         CPartylineChannel* pChannel;
@@ -212,9 +739,9 @@ class CPartylineMod : public CModule {
                 pChannel = FindChannel(sKey);
                 if (pChannel && !(it->second).empty()) {
 
-                    PutChan(pChannel->GetUsers(), ":irc.znc.in TOPIC " +
-                                                      pChannel->GetName() +
-                                                      " :" + it->second);
+                    PutChan(pChannel, ":irc.znc.in TOPIC " +
+                                          pChannel->GetName() + " :" +
+                                          it->second);
                     pChannel->SetTopic(it->second);
                 }
             }
@@ -231,10 +758,11 @@ class CPartylineMod : public CModule {
     }
 
     EModRet OnDeleteUser(CUser& User) override {
+        InvalidateClients();
+
         // Loop through each chan
-        for (set<CPartylineChannel*>::iterator it = m_ssChannels.begin();
-             it != m_ssChannels.end();) {
-            CPartylineChannel* pChan = *it;
+        for (auto it = m_msChannels.begin(); it != m_msChannels.end();) {
+            CPartylineChannel* pChan = it->second;
             // RemoveUser() might delete channels, so make sure our
             // iterator doesn't break.
             ++it;
@@ -267,6 +795,8 @@ class CPartylineMod : public CModule {
     }
 
     void OnClientLogin() override {
+        InvalidateClients();
+
         CUser* pUser = GetUser();
         CClient* pClient = GetClient();
         CIRCNetwork* pNetwork = GetNetwork();
@@ -277,17 +807,23 @@ class CPartylineMod : public CModule {
         }
 
         // Only join default channels on this specific network
+        set<CPartylineChannel*> spJoined;
         for (const CString& sChan : m_ssDefaultChans) {
             CPartylineChannel* pChannel = GetChannel(sChan);
 
             if (!pChannel->IsInChannel(pUser->GetUserName(), pNetwork)) {
                 JoinUser(pUser, pNetwork, pChannel);
+                spJoined.insert(pChannel);
             }
         }
 
         // Show existing channels on this network
         CString sNickMask = pClient->GetNickMask();
-        for (CPartylineChannel* pChannel : m_ssChannels) {
+        for (const auto& it : m_msChannels) {
+            CPartylineChannel* pChannel = it.second;
+            // JoinUser() already sent everything to this client
+            if (spJoined.count(pChannel)) continue;
+
             if (pChannel->IsInChannel(pUser->GetUserName(), pNetwork)) {
                 pClient->PutClient(":" + sNickMask + " JOIN " + pChannel->GetName());
 
@@ -299,6 +835,7 @@ class CPartylineMod : public CModule {
                 }
 
                 SendNickList(pUser, pNetwork, pChannel->GetUsers(), pChannel->GetName());
+                ReplayHistory(pClient, pChannel);
             }
         }
     }
@@ -307,21 +844,41 @@ class CPartylineMod : public CModule {
         CUser* pUser = GetUser();
         CIRCNetwork* pNetwork = GetNetwork();
 
-        if (!pUser->IsUserAttached() && !pUser->IsBeingDeleted()) {
-            for (set<CPartylineChannel*>::iterator it = m_ssChannels.begin();
-                 it != m_ssChannels.end(); ++it) {
-                const set<SPartylineUser>& ssUsers = (*it)->GetUsers();
+        // The client is still attached until this returns, keep it out of
+        // any fan-out lists built in the meantime
+        m_pDetaching = GetClient();
+        InvalidateClients();
 
-                if (ssUsers.find({pUser->GetUserName(), pNetwork}) != ssUsers.end()) {
-                    PutChan(ssUsers,
+        if (!pUser->IsUserAttached() && !pUser->IsBeingDeleted()) {
+            for (const auto& it : m_msChannels) {
+                CPartylineChannel* pChannel = it.second;
+                if (pChannel->IsInChannel(pUser->GetUserName(), pNetwork)) {
+                    PutChan(pChannel,
                             ":*" + GetModName() + "!znc@znc.in MODE " +
-                                (*it)->GetName() + " -ov " + NICK_PREFIX +
+                                pChannel->GetName() + " -ov " + NICK_PREFIX +
                                 pUser->GetUserName() + " " + NICK_PREFIX +
                                 pUser->GetUserName(),
                             false, true, pUser, nullptr, pNetwork);
                 }
             }
         }
+
+        m_pDetaching = nullptr;
+    }
+
+    void OnClientAttached() override {
+        m_pDetaching = nullptr;
+        InvalidateClients();
+    }
+
+    void OnClientDetached() override {
+        m_pDetaching = GetClient();
+        InvalidateClients();
+    }
+
+    EModRet OnDeleteNetwork(CIRCNetwork& Network) override {
+        InvalidateClients();
+        return CONTINUE;
     }
 
     EModRet OnUserRawMessage(CMessage& Msg) override {
@@ -342,12 +899,14 @@ class CPartylineMod : public CModule {
             CPartylineChannel* pChannel = FindChannel(sChannel);
 
             if (pChannel && pChannel->IsInChannel(pUser->GetUserName(), pNetwork)) {
-                const set<SPartylineUser>& ssUsers = pChannel->GetUsers();
                 if (!sTopic.empty()) {
                     if (pUser->IsAdmin()) {
-                        PutChan(ssUsers, ":" + pClient->GetNickMask() + " TOPIC " + sChannel + " :" + sTopic, true, false, pUser, nullptr, pNetwork);
+                        PutChan(pChannel, ":" + pClient->GetNickMask() + " TOPIC " + sChannel + " :" + sTopic, true, false, pUser, nullptr, pNetwork);
                         pChannel->SetTopic(sTopic);
                         SaveTopic(pChannel);
+                        LinkSend("TOPIC " + pChannel->GetName() + " " +
+                                 LinkUser(pUser->GetUserName()) + " :" +
+                                 sTopic);
                     } else {
                         pUser->PutUser(":irc.znc.in 482 " + pClient->GetNick() +
                                        " " + sChannel +
@@ -408,10 +967,17 @@ class CPartylineMod : public CModule {
 
         // Remove user from specific network
         pChannel->DelUser(pUser->GetUserName(), pNetwork);
+        DelQueryNetwork(pUser->GetUserName(), pNetwork);
+
+        if (pChannel->GetUserNetworks(pUser->GetUserName()).empty()) {
+            LinkSend("PART " + pChannel->GetName() + " " +
+                     LinkUser(pUser->GetUserName()) + " :" + sMessage);
+        }
 
         // Only send PART to clients on this network
         CString sCmd = " " + sCommand + " ";
         CString sMsg = sMessage.empty() ? "" : " :" + sMessage;
+        CNickSlotLine Part(":", sCmd + pChannel->GetName() + sMsg);
 
         for (CClient* pClient : pUser->GetAllClients()) {
             if (pClient->GetNetwork() == pNetwork) {
@@ -420,8 +986,7 @@ class CPartylineMod : public CModule {
                                        pChannel->GetName() + " " +
                                        pClient->GetNick() + sMsg);
                 } else {
-                    pClient->PutClient(":" + pClient->GetNickMask() + sCmd +
-                                       pChannel->GetName() + sMsg);
+                    pClient->PutClient(Part.For(pClient->GetNickMask()));
                 }
             }
         }
@@ -441,7 +1006,7 @@ class CPartylineMod : public CModule {
         }
         sPartMsg += sMsg;
 
-        PutChan(pChannel->GetUsers(), sPartMsg, false, true, pUser, nullptr, pNetwork);
+        PutChan(pChannel, sPartMsg, false, true, pUser, nullptr, pNetwork);
 
         // Rejoin if default channel and not being deleted
         if (!pUser->IsBeingDeleted() &&
@@ -449,11 +1014,20 @@ class CPartylineMod : public CModule {
             JoinUser(pUser, pNetwork, pChannel);
         }
 
-        // Delete channel if empty across all networks
-        if (pChannel->GetUsers().empty()) {
-            delete pChannel;
-            m_ssChannels.erase(pChannel);
+        DelChannelIfEmpty(pChannel);
+    }
+
+    // Delete channel if empty across all networks and instances
+    void DelChannelIfEmpty(CPartylineChannel* pChannel) {
+        if (!pChannel->GetUsers().empty()) return;
+
+        if (m_bSaveHistory && !pChannel->GetHistory().empty()) {
+            m_mSavedHistory[pChannel->GetName()] =
+                std::move(pChannel->GetHistory());
         }
+
+        m_msChannels.erase(pChannel->GetName());
+        delete pChannel;
     }
 
     EModRet OnUserJoin(CString& sChannel, CString& sKey) override {
@@ -484,12 +1058,19 @@ class CPartylineMod : public CModule {
 
         // Add user with specific network
         pChannel->AddUser(pUser->GetUserName(), pNetwork);
+        m_mQueryNetworks[pUser->GetUserName()][pNetwork]++;
+
+        if (pChannel->GetUserNetworks(pUser->GetUserName()).size() == 1) {
+            LinkSend("JOIN " + pChannel->GetName() + " " +
+                     LinkUser(pUser->GetUserName()) +
+                     (pUser->IsAdmin() ? " @" : ""));
+        }
 
         // Only send JOIN to clients on this network
+        CNickSlotLine Join(":", " JOIN " + pChannel->GetName());
         for (CClient* pClient : pUser->GetAllClients()) {
             if (pClient->GetNetwork() == pNetwork) {
-                pClient->PutClient(":" + pClient->GetNickMask() + " JOIN " +
-                                   pChannel->GetName());
+                pClient->PutClient(Join.For(pClient->GetNickMask()));
             }
         }
 
@@ -503,28 +1084,34 @@ class CPartylineMod : public CModule {
                            pUser->GetIdent() + "@" + sHost + " JOIN " +
                            pChannel->GetName();
 
-        PutChan(pChannel->GetUsers(), sJoinMsg, false, true, pUser, nullptr, pNetwork);
+        PutChan(pChannel, sJoinMsg, false, true, pUser, nullptr, pNetwork);
 
         // Send topic and names list only to clients on this network
         if (!pChannel->GetTopic().empty()) {
+            CNickSlotLine Topic(":" + GetIRCServer(pNetwork) + " 332 ",
+                                " " + pChannel->GetName() + " :" +
+                                    pChannel->GetTopic());
             for (CClient* pClient : pUser->GetAllClients()) {
                 if (pClient->GetNetwork() == pNetwork) {
-                    pClient->PutClient(":" + GetIRCServer(pNetwork) + " 332 " +
-                                       pClient->GetNickMask() + " " +
-                                       pChannel->GetName() + " :" +
-                                       pChannel->GetTopic());
+                    pClient->PutClient(Topic.For(pClient->GetNickMask()));
                 }
             }
         }
 
         SendNickList(pUser, pNetwork, pChannel->GetUsers(), pChannel->GetName());
 
+        for (CClient* pClient : pUser->GetAllClients()) {
+            if (pClient->GetNetwork() == pNetwork) {
+                ReplayHistory(pClient, pChannel);
+            }
+        }
+
         // Set modes only on this network
         if (pUser->IsAdmin()) {
-            PutChan(pChannel->GetUsers(), ":*" + GetModName() + "!znc@znc.in MODE " + pChannel->GetName() + " +o " + NICK_PREFIX + pUser->GetUserName(),
+            PutChan(pChannel, ":*" + GetModName() + "!znc@znc.in MODE " + pChannel->GetName() + " +o " + NICK_PREFIX + pUser->GetUserName(),
                     false, false, pUser, nullptr, pNetwork);
         }
-        PutChan(pChannel->GetUsers(), ":*" + GetModName() + "!znc@znc.in MODE " + pChannel->GetName() + " +v " + NICK_PREFIX + pUser->GetUserName(),
+        PutChan(pChannel, ":*" + GetModName() + "!znc@znc.in MODE " + pChannel->GetName() + " +v " + NICK_PREFIX + pUser->GetUserName(),
                 false, false, pUser, nullptr, pNetwork);
     }
 
@@ -569,14 +1156,23 @@ class CPartylineMod : public CModule {
                            " " + sTarget + " :" + sMessage;
 
             // Send to all users in channel (cross-network)
-            PutChan(pChannel->GetUsers(), sMsg, true, false, pUser, nullptr, pNetwork);
+            PutChan(pChannel, sMsg, true, false, pUser, nullptr, pNetwork);
+
+            timeval tv;
+            gettimeofday(&tv, nullptr);
+            pChannel->GetHistory().Add(tv, sMsg);
+
+            LinkSend("MSG " + pChannel->GetName() + " " +
+                     LinkUser(pUser->GetUserName()) + " " + sCmd + " :" +
+                     sMessage);
         } else {
             // Private message handling remains similar
             CString sNick = sTarget.LeftChomp_n(1);
             CUser* pTargetUser = CZNC::Get().FindUser(sNick);
 
             if (pTargetUser) {
-                vector<CClient*> vClients = pTargetUser->GetAllClients();
+                const vector<CClient*>& vClients =
+                    pTargetUser->GetAllClients();
                 if (vClients.empty()) {
                     pClient->PutClient(":" + GetIRCServer(pNetwork) + " 401 " +
                                        pClient->GetNick() + " " + sTarget +
@@ -584,10 +1180,33 @@ class CPartylineMod : public CModule {
                     return HALT;
                 }
 
-                for (CClient* pTarget : vClients) {
-                    pTarget->PutClient(":" + NICK_PREFIX + pUser->GetUserName() + "!" +
-                                       pUser->GetIdent() + "@" + sHost + " " + sCmd +
-                                       " " + pTarget->GetNick() + " :" + sMessage);
+                CNickSlotLine Msg(":" + NICK_PREFIX + pUser->GetUserName() +
+                                      "!" + pUser->GetIdent() + "@" + sHost +
+                                      " " + sCmd + " ",
+                                  " :" + sMessage);
+
+                // Only the networks the user has partyline channels on
+                bool bSent = false;
+                auto itNetworks =
+                    m_mQueryNetworks.find(pTargetUser->GetUserName());
+                if (itNetworks != m_mQueryNetworks.end()) {
+                    for (CClient* pTarget : vClients) {
+                        if (itNetworks->second.count(pTarget->GetNetwork())) {
+                            pTarget->PutClient(Msg.For(pTarget->GetNick()));
+                            bSent = true;
+                        }
+                    }
+                }
+
+                if (!bSent && m_bQueryAll) {
+                    for (CClient* pTarget : vClients) {
+                        pTarget->PutClient(Msg.For(pTarget->GetNick()));
+                    }
+                } else if (!bSent) {
+                    pClient->PutClient(":" + GetIRCServer(pNetwork) + " 401 " +
+                                       pClient->GetNick() + " " + sTarget +
+                                       " :User is not on the partyline: " +
+                                       sNick);
                 }
             } else {
                 pClient->PutClient(":" + GetIRCServer(pNetwork) + " 401 " +
@@ -631,55 +1250,78 @@ class CPartylineMod : public CModule {
         CPartylineChannel* pChannel = FindChannel(sChan);
 
         if (pChannel != nullptr) {
-            PutChan(pChannel->GetUsers(), sLine, bIncludeCurUser,
-                    bIncludeClient, pUser, pClient, GetNetwork());
+            PutChan(pChannel, sLine, bIncludeCurUser, bIncludeClient, pUser,
+                    pClient, GetNetwork());
             return true;
         }
 
         return false;
     }
 
-    void PutChan(const set<SPartylineUser>& ssUsers, const CString& sLine,
+    void PutChan(CPartylineChannel* pChannel, const CString& sLine,
                  bool bIncludeCurUser = true, bool bIncludeClient = true,
                  CUser* pUser = nullptr, CClient* pClient = nullptr,
                  CIRCNetwork* pSenderNetwork = nullptr) {
-        const map<CString, CUser*>& msUsers = CZNC::Get().GetUserMap();
-
         if (!pUser) pUser = GetUser();
         if (!pClient) pClient = GetClient();
 
-        for (const SPartylineUser& partylineUser : ssUsers) {
-            CUser* pTargetUser = CZNC::Get().FindUser(partylineUser.sUsername);
-            if (!pTargetUser) continue;
-
-            // Check if this is the sender
-            bool isSender = (pTargetUser == pUser);
+        for (const SPartylineClient& Target : GetChanClients(pChannel)) {
+            // Clients that jumped networks since the list was built
+            if (Target.pClient->GetNetwork() != Target.pNetwork) continue;
 
-            if (isSender && !bIncludeCurUser) {
-                continue;
+            if (Target.pUser == pUser) {
+                if (!bIncludeCurUser) continue;
+                if (!bIncludeClient && Target.pClient == pClient) continue;
             }
 
-            // Get all clients for this user
-            vector<CClient*> vClients = pTargetUser->GetAllClients();
+            Target.pClient->PutClient(sLine);
+        }
+    }
+
+    // Clients of every member, on the network they joined the channel on
+    const vector<SPartylineClient>& GetChanClients(
+        CPartylineChannel* pChannel) {
+        if (pChannel->HasClients(m_uClientsGen)) return pChannel->GetClients();
 
-            for (CClient* pTargetClient : vClients) {
-                // For the sender, check if we should exclude this specific client
-                if (isSender && !bIncludeClient && pTargetClient == pClient) {
-                    continue;
-                }
+        vector<SPartylineClient> vClients;
+        for (const SPartylineUser& User : pChannel->GetUsers()) {
+            CUser* pUser = CZNC::Get().FindUser(User.sUsername);
+            if (!pUser || pUser->IsBeingDeleted()) continue;
 
-                // Send the message to this client
-                pTargetClient->PutClient(sLine);
+            for (CClient* pClient : pUser->GetAllClients()) {
+                if (pClient != m_pDetaching &&
+                    pClient->GetNetwork() == User.pNetwork) {
+                    vClients.push_back({pUser, User.pNetwork, pClient});
+                }
             }
         }
+
+        pChannel->SetClients(std::move(vClients), m_uClientsGen);
+        return pChannel->GetClients();
+    }
+
+    void DelQueryNetwork(const CString& sUsername, CIRCNetwork* pNetwork) {
+        auto it = m_mQueryNetworks.find(sUsername);
+        if (it == m_mQueryNetworks.end()) return;
+
+        auto it2 = it->second.find(pNetwork);
+        if (it2 == it->second.end()) return;
+
+        if (--it2->second == 0) it->second.erase(it2);
+        if (it->second.empty()) m_mQueryNetworks.erase(it);
+    }
+
+    // Called whenever clients come, go or switch networks
+    void InvalidateClients() {
+        // 0 marks a channel whose list was never built
+        if (++m_uClientsGen == 0) ++m_uClientsGen;
     }
 
     void PutUserIRCNick(CUser* pUser, const CString& sPre,
                         const CString& sPost) {
-        const vector<CClient*>& vClients = pUser->GetAllClients();
-        vector<CClient*>::const_iterator it;
-        for (it = vClients.begin(); it != vClients.end(); ++it) {
-            (*it)->PutClient(sPre + (*it)->GetNick() + sPost);
+        CNickSlotLine Line(sPre, sPost);
+        for (CClient* pClient : pUser->GetAllClients()) {
+            pClient->PutClient(Line.For(pClient->GetNick()));
         }
     }
 
@@ -727,33 +1369,513 @@ class CPartylineMod : public CModule {
     }
 
     CPartylineChannel* FindChannel(const CString& sChan) {
-        CString sChannel = sChan.AsLower();
-
-        for (set<CPartylineChannel*>::iterator it = m_ssChannels.begin();
-             it != m_ssChannels.end(); ++it) {
-            if ((*it)->GetName().AsLower() == sChannel) return *it;
-        }
-
-        return nullptr;
+        auto it = m_msChannels.find(sChan);
+        return it == m_msChannels.end() ? nullptr : it->second;
     }
 
     CPartylineChannel* GetChannel(const CString& sChannel) {
         CPartylineChannel* pChannel = FindChannel(sChannel);
 
         if (!pChannel) {
-            pChannel = new CPartylineChannel(sChannel.AsLower());
-            m_ssChannels.insert(pChannel);
+            pChannel = new CPartylineChannel(sChannel);
+            m_msChannels[pChannel->GetName()] = pChannel;
+
+            auto it = m_mSavedHistory.find(pChannel->GetName());
+            if (it != m_mSavedHistory.end()) {
+                pChannel->GetHistory() = std::move(it->second);
+                m_mSavedHistory.erase(it);
+            }
+            pChannel->GetHistory().SetSize(m_uHistoryLines);
         }
 
         return pChannel;
     }
 
+    // Linked instances
+
+    // How users of this instance are known on the others
+    CString LinkUser(const CString& sUsername) const {
+        return sUsername + LINK_SEP + m_sLinkName;
+    }
+
+    // Whether a remote member joined as an admin of their instance, over
+    // whichever link the JOIN came in
+    bool IsLinkAdmin(const CString& sChan, const CString& sUser) {
+        for (CPartylineLink* pLink : GetLinks()) {
+            if (pLink->GetAdmins().count({sChan, sUser})) return true;
+        }
+        return false;
+    }
+
+    bool HasLinkMembers(CPartylineChannel* pChannel, const CString& sOrigin) {
+        for (const SPartylineUser& User : pChannel->GetUsers()) {
+            if (User.sUsername.Token(1, true, LINK_SEP).Equals(sOrigin)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The listen password is saved as "salt$hash". GetSalt() never uses $.
+    CString HashLinkPass(const CString& sPass) const {
+        CString sSalt = CUtils::GetSalt();
+        return sSalt + "$" + CUtils::SaltedSHA256Hash(sPass, sSalt);
+    }
+
+    bool IsLinkPassHash(const CString& sStored) const {
+        return sStored.Token(1, true, "$").length() == 64;
+    }
+
+    bool CheckLinkPass(const CString& sPass, const CString& sStored) const {
+        if (!IsLinkPassHash(sStored)) return SameSecret(sPass, sStored);
+        CString sSalt = sStored.Token(0, false, "$");
+        return SameSecret(CUtils::SaltedSHA256Hash(sPass, sSalt),
+                          sStored.Token(1, true, "$"));
+    }
+
+    // Takes as long for a wrong password as for a right one
+    static bool SameSecret(const CString& sA, const CString& sB) {
+        unsigned char uDiff = sA.length() != sB.length();
+        for (size_t i = 0; i < sA.length() && i < sB.length(); i++) {
+            uDiff |= sA[i] ^ sB[i];
+        }
+        return uDiff == 0;
+    }
+
+    // Remote users are ?user|instance!user@instance
+    CString LinkMask(const CString& sUser) const {
+        return NICK_PREFIX + sUser + "!" + sUser.Token(0, false, LINK_SEP) +
+               "@" + sUser.Token(1, true, LINK_SEP);
+    }
+
+    vector<CPartylineLink*> GetLinks() {
+        vector<CPartylineLink*> vLinks;
+        for (auto it = BeginSockets(); it != EndSockets(); ++it) {
+            CPartylineLink* pLink = dynamic_cast<CPartylineLink*>(*it);
+            if (pLink) vLinks.push_back(pLink);
+        }
+        return vLinks;
+    }
+
+    CPartylineLink* FindLink(const CString& sPeer) {
+        for (CPartylineLink* pLink : GetLinks()) {
+            if (pLink->GetPeer().Equals(sPeer)) return pLink;
+        }
+        return nullptr;
+    }
+
+    // Lines that start here get the next number
+    CString LinkNumber() {
+        return "@" + m_sLinkName + LINK_SEP + CString(++m_uLinkSeq) + " ";
+    }
+
+    void LinkSend(const CString& sLine, CPartylineLink* pExcept = nullptr) {
+        if (m_sLinkName.empty()) return;
+        LinkRelay(LinkNumber() + sLine, pExcept);
+    }
+
+    // Passes a numbered line on as it is
+    void LinkRelay(const CString& sLine, CPartylineLink* pExcept) {
+        for (CPartylineLink* pLink : GetLinks()) {
+            if (pLink != pExcept && pLink->IsLinked()) pLink->Send(sLine);
+        }
+    }
+
+    // Whether a numbered line was handled already, remembers it if not.
+    // Numbers only grow, they start from the time the module was loaded.
+    bool LinkSeen(const CString& sOrigin, unsigned long long uSeq) {
+        if (sOrigin.empty() || sOrigin.Equals(m_sLinkName)) return true;
+
+        set<unsigned long long>& suSeen = m_msuLinkSeen[sOrigin.AsLower()];
+        if (suSeen.size() >= LINK_SEEN && uSeq < *suSeen.begin()) return true;
+        if (!suSeen.insert(uSeq).second) return true;
+        if (suSeen.size() > LINK_SEEN) suSeen.erase(suSeen.begin());
+        return false;
+    }
+
+    bool Listen() {
+        StopListening();
+
+        CString sListen = GetNV("link:listen");
+        CString sPort = sListen.Token(0);
+        CString sHost = sListen.Token(2);
+        if (m_sLinkName.empty() || sPort.empty()) return false;
+        if (sHost.empty()) sHost = LINK_LISTEN_HOST;
+        if (sHost == "*") sHost = "";
+
+        bool bSSL = sPort.TrimPrefix("+");
+        CPartylineListener* pListener = new CPartylineListener(this);
+        // CSocket::Listen() can only bind to all addresses
+        if (!GetManager()->ListenHost(sPort.ToUShort(),
+                                      "MOD::L::" + GetModName(), sHost, bSSL,
+                                      SOMAXCONN, pListener)) {
+            RemSocket(pListener);
+            return false;
+        }
+        return true;
+    }
+
+    void StopListening() {
+        for (auto it = BeginSockets(); it != EndSockets(); ++it) {
+            if (dynamic_cast<CPartylineListener*>(*it)) {
+                RemSocket(*it);
+                return;
+            }
+        }
+    }
+
+    // Connects every configured link that is not up
+    void ConnectLinks() {
+        if (m_sLinkName.empty()) return;
+
+        for (MCString::iterator it = BeginNV(); it != EndNV(); ++it) {
+            if (!it->first.StartsWith("link:peer:")) continue;
+
+            CString sPeer = it->first.Token(2, true, ":");
+            if (FindLink(sPeer)) continue;
+
+            CString sHost = it->second.Token(0);
+            CString sPort = it->second.Token(1);
+            bool bSSL = sPort.TrimPrefix("+");
+
+            CPartylineLink* pLink = new CPartylineLink(this, sPeer);
+            pLink->Connect(sHost, sPort.ToUShort(), bSSL);
+        }
+    }
+
+    void LinkTick() {
+        if (m_sLinkName.empty()) return;
+        for (CPartylineLink* pLink : GetLinks()) pLink->Flush();
+
+        if (++m_uLinkTicks < LINK_INTERVAL) return;
+        m_uLinkTicks = 0;
+
+        for (CPartylineLink* pLink : GetLinks()) {
+            if (pLink->IsLinked()) pLink->Send("PING :" + m_sLinkName);
+        }
+        ConnectLinks();
+    }
+
+    void LinkConnected(CPartylineLink* pLink) {
+        CString sPeer = pLink->GetPeer();
+        pLink->Send("LINK " LINK_PROTO " " + m_sLinkName + " " +
+                    GetNV("link:peer:" + sPeer).Token(2));
+    }
+
+    // Everything this instance knows, minus what came from the link itself
+    void SendBurst(CPartylineLink* pLink) {
+        for (const auto& it : m_msChannels) {
+            CPartylineChannel* pChannel = it.second;
+
+            set<CString> ssSent;
+            for (const SPartylineUser& User : pChannel->GetUsers()) {
+                CString sUser = User.sUsername;
+                bool bAdmin;
+                if (sUser.find(LINK_SEP) == CString::npos) {
+                    CUser* pUser = CZNC::Get().FindUser(sUser);
+                    bAdmin = pUser && pUser->IsAdmin();
+                    sUser = LinkUser(sUser);
+                } else if (pLink->GetMembers().count(
+                               {pChannel->GetName(), sUser})) {
+                    continue;
+                } else {
+                    bAdmin = IsLinkAdmin(pChannel->GetName(), sUser);
+                }
+
+                if (ssSent.insert(sUser).second) {
+                    pLink->Send(LinkNumber() + "JOIN " + pChannel->GetName() +
+                                " " + sUser + (bAdmin ? " @" : ""));
+                }
+            }
+
+            if (!ssSent.empty() && !pChannel->GetTopic().empty()) {
+                pLink->Send(LinkNumber() + "TOPIC " + pChannel->GetName() +
+                            " " + LinkUser("*") + " :" + pChannel->GetTopic());
+            }
+        }
+        pLink->Send(LinkNumber() + "BURST");
+    }
+
+    void LinkLine(CPartylineLink* pLink, const CString& sLine) {
+        CString sCmd = sLine.Token(0);
+
+        if (sCmd.Equals("PING")) {
+            pLink->Send("PONG " + sLine.Token(1, true));
+            return;
+        } else if (sCmd.Equals("PONG")) {
+            return;
+        } else if (sCmd.Equals("ERROR")) {
+            DEBUG("partyline: link " << pLink->GetPeer() << " error: "
+                                     << sLine.Token(1, true));
+            return;
+        }
+
+        if (!pLink->IsLinked()) {
+            LinkHandshake(pLink, sLine);
+            return;
+        }
+
+        // Dropped if it came in over another link already
+        CString sNumber = sLine.Token(0);
+        if (!sNumber.TrimPrefix("@") ||
+            LinkSeen(sNumber.Token(0, false, LINK_SEP),
+                     sNumber.Token(1, false, LINK_SEP).ToULongLong())) {
+            return;
+        }
+
+        CString sEvent = sLine.Token(1, true);
+        sCmd = sEvent.Token(0);
+        CString sChan = sEvent.Token(1);
+        CString sUser = sEvent.Token(2);
+        CString sOrigin = sUser.Token(1, true, LINK_SEP);
+
+        // Our own users coming back around, or garbage
+        if (sChan.Left(2) != CHAN_PREFIX || sChan.size() > 32 ||
+            sOrigin.empty() || sOrigin.Equals(m_sLinkName)) {
+            return;
+        }
+
+        CPartylineChannel* pChannel = FindChannel(sChan);
+
+        if (sCmd.Equals("JOIN")) {
+            if (!pChannel) pChannel = GetChannel(sChan);
+            if (pChannel->IsInChannel(sUser, nullptr)) return;
+
+            pChannel->AddUser(sUser, nullptr);
+            pLink->GetMembers().insert({pChannel->GetName(), sUser});
+            if (sEvent.Token(3) == "@") {
+                pLink->GetAdmins().insert({pChannel->GetName(), sUser});
+            }
+            PutChan(pChannel, ":" + LinkMask(sUser) + " JOIN " +
+                                  pChannel->GetName());
+        } else if (sCmd.Equals("PART")) {
+            if (!pChannel ||
+                !pLink->GetMembers().erase({pChannel->GetName(), sUser})) {
+                return;
+            }
+
+            CString sMsg = sEvent.Token(3, true).TrimPrefix_n(":");
+            pLink->GetAdmins().erase({pChannel->GetName(), sUser});
+            pChannel->DelUser(sUser, nullptr);
+            PutChan(pChannel, ":" + LinkMask(sUser) + " PART " +
+                                  pChannel->GetName() +
+                                  (sMsg.empty() ? "" : " :" + sMsg));
+            LinkRelay(sLine, pLink);
+            DelChannelIfEmpty(pChannel);
+            return;
+        } else if (sCmd.Equals("TOPIC")) {
+            if (!pChannel) return;
+            CString sTopic = sEvent.Token(3, true).TrimPrefix_n(":");
+
+            // Topics in a burst only fill in channels without one, and only
+            // in channels the sending instance has members in
+            if (sUser.Token(0, false, LINK_SEP) == "*") {
+                if (!pChannel->GetTopic().empty() ||
+                    !HasLinkMembers(pChannel, sOrigin)) {
+                    return;
+                }
+                PutChan(pChannel, ":irc.znc.in TOPIC " + pChannel->GetName() +
+                                      " :" + sTopic);
+            } else {
+                // Only admins may set it, same as for our own users
+                if (!IsLinkAdmin(pChannel->GetName(), sUser)) return;
+                PutChan(pChannel, ":" + LinkMask(sUser) + " TOPIC " +
+                                      pChannel->GetName() + " :" + sTopic);
+            }
+            pChannel->SetTopic(sTopic);
+            SaveTopic(pChannel);
+        } else if (sCmd.Equals("MSG")) {
+            if (!pChannel || !pChannel->IsInChannel(sUser, nullptr)) return;
+
+            CString sType = sEvent.Token(3).Equals("NOTICE") ? "NOTICE"
+                                                              : "PRIVMSG";
+            CString sMsg = ":" + LinkMask(sUser) + " " + sType + " " +
+                           pChannel->GetName() + " :" +
+                           sEvent.Token(4, true).TrimPrefix_n(":");
+            PutChan(pChannel, sMsg);
+
+            timeval tv;
+            gettimeofday(&tv, nullptr);
+            pChannel->GetHistory().Add(tv, sMsg);
+        } else {
+            return;
+        }
+
+        // Pass it on to everyone else, LinkSeen() stops it from going around
+        // in circles when the links do
+        LinkRelay(sLine, pLink);
+    }
+
+    void LinkHandshake(CPartylineLink* pLink, const CString& sLine) {
+        CString sPeer = sLine.Token(2);
+        CString sPass = sLine.Token(3);
+
+        // Links we start send the peer's password as it is, so only the
+        // listen password can be kept hashed
+        bool bPass = pLink->IsOutgoing()
+                         ? SameSecret(sPass, GetNV("link:peer:" +
+                                                   pLink->GetPeer())
+                                                 .Token(2))
+                         : CheckLinkPass(sPass, GetNV("link:listen").Token(1));
+
+        CString sError;
+        if (!sLine.Token(0).Equals("LINK") || sLine.Token(1) != LINK_PROTO) {
+            sError = "Protocol mismatch";
+        } else if (sPass.empty() || !bPass) {
+            sError = "Bad password";
+        } else if (pLink->IsOutgoing() && !sPeer.Equals(pLink->GetPeer())) {
+            sError = "Expected " + pLink->GetPeer();
+        } else if (sPeer.empty() || sPeer.Equals(m_sLinkName) ||
+                   sPeer.find(LINK_SEP) != CString::npos) {
+            sError = "Bad name";
+        } else if (!pLink->IsOutgoing() && !KeepIncoming(sPeer)) {
+            sError = "Already linked";
+        }
+
+        if (!sError.empty()) {
+            pLink->Write("ERROR :" + sError + "\n");
+            pLink->Close(Csock::CLT_AFTERWRITE);
+            return;
+        }
+
+        if (!pLink->IsOutgoing()) {
+            pLink->SetPeer(sPeer);
+            pLink->Send("LINK " LINK_PROTO " " + m_sLinkName + " " + sPass);
+        }
+
+        pLink->SetLinked(true);
+        SendBurst(pLink);
+    }
+
+    // Both ends may link to each other at the same time. Of two links
+    // between the same instances, both keep the one started by the instance
+    // with the lower name.
+    bool KeepIncoming(const CString& sPeer) {
+        CPartylineLink* pOther = FindLink(sPeer);
+        if (!pOther) return true;
+        if (!pOther->IsOutgoing() || m_sLinkName.AsLower() < sPeer.AsLower()) {
+            return false;
+        }
+
+        LinkLost(pOther);
+        pOther->SetPeer("");
+        pOther->Write("ERROR :Duplicate link\n");
+        pOther->Close(Csock::CLT_AFTERWRITE);
+        return true;
+    }
+
+    // Everyone that came over a link leaves when it goes down
+    void LinkLost(CPartylineLink* pLink) {
+        pLink->SetLinked(false);
+
+        for (const auto& Member : pLink->GetMembers()) {
+            CPartylineChannel* pChannel = FindChannel(Member.first);
+            if (!pChannel) continue;
+
+            pChannel->DelUser(Member.second, nullptr);
+            PutChan(pChannel, ":" + LinkMask(Member.second) + " PART " +
+                                  pChannel->GetName() + " :" +
+                                  pLink->GetPeer() + " split");
+            LinkSend("PART " + pChannel->GetName() + " " + Member.second +
+                         " :" + pLink->GetPeer() + " split",
+                     pLink);
+            DelChannelIfEmpty(pChannel);
+        }
+        pLink->GetMembers().clear();
+        pLink->GetAdmins().clear();
+    }
+
   private:
-    set<CPartylineChannel*> m_ssChannels;
+    // Keyed by the lowercase name the channel was created with
+    std::unordered_map<CString, CPartylineChannel*, SChanNameHash,
+                       SChanNameEqual>
+        m_msChannels;
     set<CIRCNetwork*> m_spInjectedPrefixes;
     set<CString> m_ssDefaultChans;
+    unsigned int m_uClientsGen = 1;
+    unsigned int m_uHistoryLines = HISTORY_LINES;
+    bool m_bSaveHistory = false;
+    // How many channels each user is in on each of their networks, /msg
+    // ?nick is delivered to clients on these networks only
+    map<CString, map<CIRCNetwork*, unsigned int>> m_mQueryNetworks;
+    bool m_bQueryAll = true;
+    // History of channels that have no members right now
+    map<CString, CPartylineHistory> m_mSavedHistory;
+    CClient* m_pDetaching = nullptr;
+    CString m_sLinkName;
+    unsigned int m_uLinkTicks = 0;
+    unsigned long long m_uLinkSeq = 0;
+    // Numbers of the lines LinkSeen() was asked about, by instance
+    map<CString, set<unsigned long long>> m_msuLinkSeen;
 };
 
+CPartylineLink::CPartylineLink(CPartylineMod* pMod, const CString& sPeer)
+    : CSocket(pMod), m_pMod(pMod), m_sPeer(sPeer), m_bOutgoing(!sPeer.empty()) {
+}
+
+void CPartylineLink::Connected() {
+    if (m_bOutgoing) m_pMod->LinkConnected(this);
+}
+
+void CPartylineLink::Disconnected() { m_pMod->LinkLost(this); }
+
+void CPartylineLink::ConnectionRefused() { m_pMod->LinkLost(this); }
+
+void CPartylineLink::Timeout() { m_pMod->LinkLost(this); }
+
+void CPartylineLink::SockError(int iErrno, const CString& sDescription) {
+    DEBUG("partyline: link " << m_sPeer << " error: " << sDescription);
+    m_pMod->LinkLost(this);
+}
+
+void CPartylineLink::ReadLine(const CString& sLine) {
+    m_pMod->LinkLine(this, sLine.TrimRight_n("\r\n"));
+}
+
+void CPartylineLink::Send(const CString& sLine) {
+    if (m_dQueue.empty() && GetInternalWriteBuffer().size() < LINK_HIGH_WATER) {
+        Write(sLine + "\n");
+        return;
+    }
+
+    if (m_dQueue.size() >= LINK_MAX_QUEUE) {
+        // Not worth holding on to, the peer will get a fresh burst
+        m_dQueue.clear();
+        Write("ERROR :SendQ exceeded\n");
+        Close(CLT_AFTERWRITE);
+        return;
+    }
+
+    m_dQueue.push_back(sLine);
+}
+
+void CPartylineLink::Flush() {
+    CString sBatch;
+    while (!m_dQueue.empty() &&
+           GetInternalWriteBuffer().size() + sBatch.size() < LINK_HIGH_WATER) {
+        sBatch += m_dQueue.front() + "\n";
+        m_dQueue.pop_front();
+    }
+
+    if (!sBatch.empty()) Write(sBatch);
+}
+
+CPartylineListener::CPartylineListener(CPartylineMod* pMod)
+    : CSocket(pMod), m_pMod(pMod) {}
+
+Csock* CPartylineListener::GetSockObj(const CString& sHost,
+                                      unsigned short uPort) {
+    return new CPartylineLink(m_pMod, "");
+}
+
+CPartylineTimer::CPartylineTimer(CPartylineMod* pMod)
+    : CTimer(pMod, 1, 0, "PartylineTimer",
+             "Flushes and reconnects links to other instances") {
+    m_pMod = pMod;
+}
+
+void CPartylineTimer::RunJob() { m_pMod->LinkTick(); }
+
 template <>
 void TModInfo<CPartylineMod>(CModInfo& Info) {
     Info.SetWikiPage("partyline");
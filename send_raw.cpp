@@ -18,9 +18,74 @@
 #include <znc/IRCNetwork.h>
 #include <znc/IRCSock.h>
 
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <random>
+
+#include "tokenbucket.h"
+
 using std::vector;
 using std::map;
 
+// Largest Bench run. All lines are built in memory before the run starts,
+// and each fake user sends 3 of them.
+#define BENCH_MAX_LINES 1000000
+#define BENCH_MAX_CHANS 1000
+// Lines a Bench run injects per second, so ZNC keeps serving everyone else
+#define BENCH_CHUNK 10000
+
+class CSendRaw_Mod;
+
+class CSendRawPacer : public CTimer {
+  public:
+    CSendRawPacer(CSendRaw_Mod* pMod);
+    ~CSendRawPacer() override {}
+
+    void RunJob() override;
+
+  private:
+    CSendRaw_Mod* m_pMod;
+};
+
+class CSendRawBench : public CTimer {
+  public:
+    CSendRawBench(CSendRaw_Mod* pMod);
+    ~CSendRawBench() override {}
+
+    void RunJob() override;
+
+  private:
+    CSendRaw_Mod* m_pMod;
+};
+
+// Lines waiting to be sent to the IRC server of one network. Drained by a
+// token bucket so that a long file doesn't trip the server's flood limits.
+struct SSendQueue {
+    CString sUser;
+    CString sNetwork;
+    std::deque<CString> dLines;
+    size_t uTotal = 0;
+    size_t uSent = 0;
+    unsigned int uLastPercent = 0;
+    CTokenBucket Bucket;
+};
+
+// A Bench run in progress. Each phase is injected in chunks and only the
+// time spent in ReadLine is counted.
+struct SBenchRun {
+    CString sUser;
+    CString sNetwork;
+    CString sMe;
+    // Channels the run created and has to remove again
+    vector<CString> vsChans;
+    vector<std::pair<CString, vector<CString>>> vPhases;
+    vector<double> vdSecs;
+    size_t uPhase = 0;
+    size_t uLine = 0;
+};
+
 class CSendRaw_Mod : public CModule {
     void SendClient(const CString& sLine) {
         CUser* pUser =
@@ -81,6 +146,463 @@ class CSendRaw_Mod : public CModule {
         }
     }
 
+    void Bench(const CString& sLine) {
+        if (!GetUser()->IsAdmin()) {
+            PutModule("Access denied!");
+            return;
+        }
+
+        CUser* pUser = FindUser(sLine.Token(1));
+        if (!pUser) return;
+
+        CIRCNetwork* pNetwork = FindNetwork(pUser, sLine.Token(2));
+        if (!pNetwork) return;
+
+        CIRCSock* pIRCSock = pNetwork->GetIRCSock();
+        if (!pIRCSock) {
+            PutModule(t_f("Network {1} is not connected to IRC")(
+                pNetwork->GetName()));
+            return;
+        }
+
+        unsigned int uCount = sLine.Token(3).ToUInt();
+        unsigned int uChans = sLine.Token(4).ToUInt();
+        unsigned int uSeed = sLine.Token(5).ToUInt();
+
+        if (uCount == 0 || uCount > BENCH_MAX_LINES / 3 ||
+            uChans > BENCH_MAX_CHANS) {
+            PutModule(t_s(
+                "Usage: Bench <user> <network> <count> [channels] [seed]"));
+            PutModule(t_f("At most {1} users in {2} channels")(
+                BENCH_MAX_LINES / 3, BENCH_MAX_CHANS));
+            return;
+        }
+        if (uChans == 0) uChans = 1;
+        if (uSeed == 0) uSeed = 1;
+
+        if (m_pBench) {
+            PutModule(t_s("A benchmark is already running"));
+            return;
+        }
+
+        // Every fake user joins, talks, parts and quits, so one "count" is
+        // several lines.
+        std::mt19937 Rand(uSeed);
+        std::uniform_int_distribution<unsigned int> ChanDist(0, uChans - 1);
+
+        vector<CString> vsChans;
+        for (unsigned int i = 0; i < uChans; i++) {
+            vsChans.push_back("#znc-bench-" + CString(i));
+        }
+
+        vector<CString> vsMasks;
+        for (unsigned int i = 0; i < uCount; i++) {
+            vsMasks.push_back("bench" + CString(i) + "!" +
+                              CString(Rand() % 100000) + "@" +
+                              CString(Rand() % 256) + "." +
+                              CString(Rand() % 256) + ".bench.invalid");
+        }
+
+        vector<unsigned int> vuTargets;
+        for (unsigned int i = 0; i < uCount; i++) {
+            vuTargets.push_back(ChanDist(Rand));
+        }
+
+        std::unique_ptr<SBenchRun> pRun(new SBenchRun);
+        pRun->sUser = pUser->GetUsername();
+        pRun->sNetwork = pNetwork->GetName();
+        pRun->sMe = pNetwork->GetIRCNick().GetNickMask();
+
+        // Build each phase up front so the timed loop only measures ZNC
+        // parsing the line and running the module hooks.
+        pRun->vPhases = {
+            {"JOIN", {}}, {"PRIVMSG", {}}, {"PART", {}}, {"QUIT", {}}};
+
+        for (unsigned int i = 0; i < uCount; i++) {
+            const CString& sMask = vsMasks[i];
+            const CString& sChan = vsChans[vuTargets[i]];
+
+            pRun->vPhases[0].second.push_back(":" + sMask + " JOIN " + sChan);
+            pRun->vPhases[1].second.push_back(":" + sMask + " PRIVMSG " +
+                                              sChan + " :benchmark line " +
+                                              CString(i));
+            // Only every other user parts, the rest quit with the channel
+            // still joined so QUIT has nicks to remove.
+            if (i % 2 == 0) {
+                pRun->vPhases[2].second.push_back(":" + sMask + " PART " +
+                                                  sChan + " :bench");
+            } else {
+                pRun->vPhases[3].second.push_back(":" + sMask +
+                                                  " QUIT :bench");
+            }
+        }
+        pRun->vdSecs.resize(pRun->vPhases.size());
+
+        // Create the channels the way a JOIN of our own nick would, so that
+        // the channel hooks of the loaded modules run. Injecting that JOIN
+        // instead would make ZNC ask the real server for the channel modes.
+        for (const CString& sChan : vsChans) {
+            if (pNetwork->FindChan(sChan)) continue;
+
+            pNetwork->AddChan(sChan, false);
+            CChan* pChan = pNetwork->FindChan(sChan);
+            if (!pChan) continue;
+
+            pChan->Enable();
+            pChan->SetIsOn(true);
+            pChan->AddNick(pRun->sMe);
+            pNetwork->PutUser(":" + pRun->sMe + " JOIN " + sChan);
+            pRun->vsChans.push_back(sChan);
+        }
+
+        PutModule(t_f("Injecting {1} lines into {2}/{3}, {4} per second")(
+            uCount * 3, pRun->sUser, pRun->sNetwork, BENCH_CHUNK));
+
+        m_pBench = std::move(pRun);
+        m_pBenchTimer = new CSendRawBench(this);
+        AddTimer(m_pBenchTimer);
+    }
+
+    // Removes the channels of the run, without telling the IRC server
+    void EndBench(CIRCNetwork* pNetwork) {
+        if (pNetwork) {
+            for (const CString& sChan : m_pBench->vsChans) {
+                if (!pNetwork->FindChan(sChan)) continue;
+                pNetwork->PutUser(":" + m_pBench->sMe + " PART " + sChan +
+                                  " :bench");
+                pNetwork->DelChan(sChan);
+            }
+        }
+
+        m_pBench.reset();
+        if (m_pBenchTimer) {
+            // The timer gets deleted by the socket manager once stopped
+            m_pBenchTimer->Stop();
+            m_pBenchTimer = nullptr;
+        }
+    }
+
+    void ReportBench() {
+        CTable Table;
+        Table.AddColumn(t_s("Phase"));
+        Table.AddColumn(t_s("Lines"));
+        Table.AddColumn(t_s("Time (ms)"));
+        Table.AddColumn(t_s("Lines/sec"));
+        Table.AddColumn(t_s("Avg (us)"));
+
+        unsigned long long uTotalLines = 0;
+        double dTotalSecs = 0;
+
+        for (size_t i = 0; i < m_pBench->vPhases.size(); i++) {
+            size_t uLines = m_pBench->vPhases[i].second.size();
+            double dSecs = m_pBench->vdSecs[i];
+
+            Table.AddRow();
+            Table.SetCell(t_s("Phase"), m_pBench->vPhases[i].first);
+            Table.SetCell(t_s("Lines"), CString(uLines));
+            Table.SetCell(t_s("Time (ms)"), CString(dSecs * 1000, 2));
+            Table.SetCell(t_s("Lines/sec"), dSecs > 0
+                                                ? CString(uLines / dSecs, 0)
+                                                : CString("-"));
+            Table.SetCell(t_s("Avg (us)"),
+                          uLines == 0 ? CString("-")
+                                      : CString(dSecs * 1000000 / uLines, 2));
+
+            uTotalLines += uLines;
+            dTotalSecs += dSecs;
+        }
+
+        PutModule(Table);
+        PutModule(t_f("Injected {1} lines into {2}/{3} in {4} ms ({5} "
+                      "lines/sec)")(
+            uTotalLines, m_pBench->sUser, m_pBench->sNetwork,
+            CString(dTotalSecs * 1000, 2),
+            dTotalSecs > 0 ? CString(uTotalLines / dTotalSecs, 0)
+                           : CString("-")));
+    }
+
+    void SendFile(const CString& sLine) {
+        CUser* pUser = FindUser(sLine.Token(1));
+        if (!pUser) return;
+
+        CIRCNetwork* pNetwork = FindNetwork(pUser, sLine.Token(2));
+        if (!pNetwork) return;
+
+        // Only files inside the module's data directory may be read
+        CString sPath =
+            CDir::CheckPathPrefix(GetSavePath(), sLine.Token(3, true));
+        if (sPath.empty()) {
+            PutModule(t_f("Files must be placed in {1}")(GetSavePath()));
+            return;
+        }
+
+        CFile File(sPath);
+        if (!File.Open()) {
+            PutModule(t_f("Unable to open {1}")(sPath));
+            return;
+        }
+
+        vector<CString> vsLines;
+        CString sRaw;
+        while (File.ReadLine(sRaw)) {
+            sRaw.TrimRight("\r\n");
+            if (!sRaw.empty()) vsLines.push_back(sRaw);
+        }
+        File.Close();
+
+        Enqueue(pUser, pNetwork, vsLines);
+    }
+
+    void Enqueue(CUser* pUser, CIRCNetwork* pNetwork,
+                 const vector<CString>& vsLines) {
+        if (vsLines.empty()) {
+            PutModule(t_s("Nothing to send"));
+            return;
+        }
+
+        SSendQueue& Queue =
+            m_msQueues[pUser->GetUsername() + "/" + pNetwork->GetName()];
+        if (Queue.dLines.empty()) {
+            Queue.sUser = pUser->GetUsername();
+            Queue.sNetwork = pNetwork->GetName();
+            Queue.uTotal = 0;
+            Queue.uSent = 0;
+            Queue.uLastPercent = 0;
+            Queue.Bucket = CTokenBucket(GetBurst(pNetwork), GetRate(pNetwork));
+        }
+
+        Queue.dLines.insert(Queue.dLines.end(), vsLines.begin(),
+                            vsLines.end());
+        Queue.uTotal += vsLines.size();
+
+        PutModule(t_f("Queued {1} lines for IRC server of {2}/{3}, ETA {4}")(
+            vsLines.size(), Queue.sUser, Queue.sNetwork,
+            GetETA(Queue, pNetwork)));
+
+        if (!m_pPacer) {
+            m_pPacer = new CSendRawPacer(this);
+            AddTimer(m_pPacer);
+        }
+    }
+
+    void QueueCommand(const CString& sLine) {
+        if (m_msQueues.empty()) {
+            PutModule(t_s("No lines are queued"));
+            return;
+        }
+
+        CTable Table;
+        Table.AddColumn(t_s("Network"));
+        Table.AddColumn(t_s("Sent"));
+        Table.AddColumn(t_s("Remaining"));
+        Table.AddColumn(t_s("Rate"));
+        Table.AddColumn(t_s("ETA"));
+
+        for (const auto& it : m_msQueues) {
+            const SSendQueue& Queue = it.second;
+            CIRCNetwork* pNetwork = GetQueueNetwork(Queue);
+
+            Table.AddRow();
+            Table.SetCell(t_s("Network"), it.first);
+            Table.SetCell(t_s("Sent"), CString(Queue.uSent) + "/" +
+                                           CString(Queue.uTotal));
+            Table.SetCell(t_s("Remaining"), CString(Queue.dLines.size()));
+            Table.SetCell(t_s("Rate"),
+                          pNetwork ? CString(GetRate(pNetwork)) + "/s"
+                                   : CString("-"));
+            Table.SetCell(t_s("ETA"), pNetwork ? GetETA(Queue, pNetwork)
+                                               : CString("-"));
+        }
+
+        PutModule(Table);
+    }
+
+    void CancelCommand(const CString& sLine) {
+        CUser* pUser = FindUser(sLine.Token(1));
+        if (!pUser) return;
+
+        CIRCNetwork* pNetwork = FindNetwork(pUser, sLine.Token(2));
+        if (!pNetwork) return;
+
+        auto it =
+            m_msQueues.find(pUser->GetUsername() + "/" + pNetwork->GetName());
+        if (it == m_msQueues.end()) {
+            PutModule(t_s("No lines are queued for that network"));
+            return;
+        }
+
+        PutModule(t_f("Dropped {1} queued lines for {2}")(
+            it->second.dLines.size(), it->first));
+        m_msQueues.erase(it);
+    }
+
+    void PaceCommand(const CString& sLine) {
+        CString sRate = sLine.Token(1);
+        CString sBurst = sLine.Token(2);
+
+        if (!sRate.empty()) {
+            if (sRate.Equals("auto")) {
+                DelNV("rate");
+                DelNV("burst");
+            } else {
+                // A rate of 0 or a burst of 0 would never send anything
+                double dRate = sRate.ToDouble();
+                if (!(dRate > 0) || (!sBurst.empty() && sBurst.ToUInt() == 0)) {
+                    PutModule(t_s("Usage: Pace [lines/sec|auto] [burst], "
+                                  "both greater than 0"));
+                    return;
+                }
+
+                SetNV("rate", CString(dRate));
+                if (!sBurst.empty()) SetNV("burst", CString(sBurst.ToUInt()));
+            }
+        }
+
+        if (GetNV("rate").ToDouble() <= 0) {
+            PutModule(t_s(
+                "Queued lines are paced using each network's flood settings"));
+        } else {
+            PutModule(t_f("Queued lines are paced at {1} lines/sec with a "
+                          "burst of {2}")(GetNV("rate"),
+                                          GetNV("burst").empty()
+                                              ? CString("1")
+                                              : GetNV("burst")));
+        }
+    }
+
+    CIRCNetwork* GetQueueNetwork(const SSendQueue& Queue) const {
+        CUser* pUser = CZNC::Get().FindUser(Queue.sUser);
+        return pUser ? pUser->FindNetwork(Queue.sNetwork) : nullptr;
+    }
+
+    // Stay within the limits the network's own flood protection uses, so
+    // that queued lines never pile up in the IRC socket's send buffer.
+    double GetRate(CIRCNetwork* pNetwork) const {
+        if (GetNV("rate").ToDouble() > 0) return GetNV("rate").ToDouble();
+        if (pNetwork->GetFloodRate() > 0) return pNetwork->GetFloodRate();
+        return 1;
+    }
+
+    double GetBurst(CIRCNetwork* pNetwork) const {
+        if (GetNV("rate").ToDouble() > 0) {
+            return std::max(1u, GetNV("burst").ToUInt());
+        }
+        if (pNetwork->GetFloodRate() > 0 && pNetwork->GetFloodBurst() > 0)
+            return pNetwork->GetFloodBurst();
+        return 1;
+    }
+
+    CString GetETA(const SSendQueue& Queue, CIRCNetwork* pNetwork) const {
+        double dRate = GetRate(pNetwork);
+        if (dRate <= 0) return "-";
+
+        double dRemaining = Queue.dLines.size() - Queue.Bucket.GetTokens();
+        if (dRemaining <= 0) return "0s";
+
+        return CString::ToTimeStr((unsigned long)(dRemaining / dRate + 0.5));
+    }
+
+  public:
+    void DrainQueues() {
+        for (auto it = m_msQueues.begin(); it != m_msQueues.end();) {
+            SSendQueue& Queue = it->second;
+            CIRCNetwork* pNetwork = GetQueueNetwork(Queue);
+
+            if (!pNetwork) {
+                PutModule(t_f("Network {1} is gone, dropped {2} queued lines")(
+                    it->first, Queue.dLines.size()));
+                it = m_msQueues.erase(it);
+                continue;
+            }
+
+            // Hold the lines while disconnected, don't let the bucket fill
+            if (!pNetwork->IsIRCConnected()) {
+                Queue.Bucket.Pause();
+                ++it;
+                continue;
+            }
+
+            // Pace or the network's flood settings may have changed
+            Queue.Bucket.SetLimits(GetBurst(pNetwork), GetRate(pNetwork));
+
+            while (!Queue.dLines.empty() && Queue.Bucket.TryTake()) {
+                pNetwork->PutIRC(Queue.dLines.front());
+                Queue.dLines.pop_front();
+                Queue.uSent++;
+            }
+
+            if (Queue.dLines.empty()) {
+                PutModule(t_f("Finished sending {1} lines to IRC server of "
+                              "{2}")(Queue.uSent, it->first));
+                it = m_msQueues.erase(it);
+                continue;
+            }
+
+            // Report progress every 10%
+            unsigned int uPercent = Queue.uSent * 100 / Queue.uTotal;
+            if (uPercent / 10 > Queue.uLastPercent / 10) {
+                Queue.uLastPercent = uPercent;
+                PutModule(t_f("{1}: sent {2}/{3} lines ({4}%), ETA {5}")(
+                    it->first, Queue.uSent, Queue.uTotal, uPercent,
+                    GetETA(Queue, pNetwork)));
+            }
+
+            ++it;
+        }
+
+        if (m_msQueues.empty() && m_pPacer) {
+            // The timer gets deleted by the socket manager once stopped
+            m_pPacer->Stop();
+            m_pPacer = nullptr;
+        }
+    }
+
+    void RunBench() {
+        if (!m_pBench) return;
+
+        CUser* pUser = CZNC::Get().FindUser(m_pBench->sUser);
+        CIRCNetwork* pNetwork =
+            pUser ? pUser->FindNetwork(m_pBench->sNetwork) : nullptr;
+        CIRCSock* pIRCSock = pNetwork ? pNetwork->GetIRCSock() : nullptr;
+
+        if (!pIRCSock) {
+            PutModule(t_f("Network {1}/{2} disconnected, benchmark aborted")(
+                m_pBench->sUser, m_pBench->sNetwork));
+            EndBench(pNetwork);
+            return;
+        }
+
+        size_t uBudget = BENCH_CHUNK;
+        while (uBudget > 0 && m_pBench->uPhase < m_pBench->vPhases.size()) {
+            const vector<CString>& vsLines =
+                m_pBench->vPhases[m_pBench->uPhase].second;
+            size_t uEnd =
+                std::min(vsLines.size(), m_pBench->uLine + uBudget);
+
+            auto Start = std::chrono::steady_clock::now();
+            for (size_t i = m_pBench->uLine; i < uEnd; i++) {
+                pIRCSock->ReadLine(vsLines[i]);
+            }
+            m_pBench->vdSecs[m_pBench->uPhase] +=
+                std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - Start)
+                    .count();
+
+            uBudget -= uEnd - m_pBench->uLine;
+            m_pBench->uLine = uEnd;
+            if (m_pBench->uLine == vsLines.size()) {
+                m_pBench->uPhase++;
+                m_pBench->uLine = 0;
+            }
+        }
+
+        if (m_pBench->uPhase < m_pBench->vPhases.size()) return;
+
+        ReportBench();
+        EndBench(pNetwork);
+    }
+
+  private:
     void CurrentClient(const CString& sLine) {
         CString sData = sLine.Token(1, true);
         GetClient()->PutClient(sData);
@@ -125,7 +647,13 @@ class CSendRaw_Mod : public CModule {
     }
 
   public:
-    ~CSendRaw_Mod() override {}
+    ~CSendRaw_Mod() override {
+        if (m_pBench) {
+            CUser* pUser = CZNC::Get().FindUser(m_pBench->sUser);
+            EndBench(pUser ? pUser->FindNetwork(m_pBench->sNetwork)
+                           : nullptr);
+        }
+    }
 
     bool OnLoad(const CString& sArgs, CString& sErrorMsg) override {
         return true;
@@ -171,13 +699,28 @@ class CSendRaw_Mod : public CModule {
                 Tmpl[bToServer ? "to_server" : "to_client"] = "true";
                 Tmpl["line"] = sLine;
 
-                if (bToServer) {
-                    pNetwork->PutIRC(sLine);
-                } else {
-                    pNetwork->PutUser(sLine);
+                VCString vsSplit, vsLines;
+                sLine.Split("\n", vsSplit, false);
+                for (const CString& sRaw : vsSplit) {
+                    CString sTrimmed = sRaw.TrimRight_n("\r");
+                    if (!sTrimmed.empty()) vsLines.push_back(sTrimmed);
                 }
 
-                WebSock.GetSession()->AddSuccess(t_s("Line sent"));
+                if (vsLines.size() > 1 && bToServer) {
+                    // Several lines to the server go through the pacer
+                    Enqueue(pUser, pNetwork, vsLines);
+                    WebSock.GetSession()->AddSuccess(
+                        t_f("{1} lines queued")(vsLines.size()));
+                } else {
+                    for (const CString& sRaw : vsLines) {
+                        if (bToServer) {
+                            pNetwork->PutIRC(sRaw);
+                        } else {
+                            pNetwork->PutUser(sRaw);
+                        }
+                    }
+                    WebSock.GetSession()->AddSuccess(t_s("Line sent"));
+                }
             }
 
             CUser* pCurrentUser = GetUser();
@@ -238,9 +781,50 @@ class CSendRaw_Mod : public CModule {
         AddCommand("ZNC", t_d("[user] [network] [data to send]"),
                    t_d("The data will be sent as if sent from the IRC server"),
                    [=](const CString& sLine) { SendZNC(sLine); });
+        AddCommand("Bench", t_d("[user] [network] [count] [channels] [seed]"),
+                   t_d("Inject synthetic JOIN/PRIVMSG/PART/QUIT traffic as if "
+                       "sent from the IRC server and report timings. The "
+                       "lines are also delivered to the attached clients of "
+                       "the network"),
+                   [=](const CString& sLine) { Bench(sLine); });
+        AddCommand("SendFile", t_d("[user] [network] [file]"),
+                   t_d("Queue the lines of a file in the module's data "
+                       "directory to be sent to the IRC server, paced to "
+                       "the network's flood limits"),
+                   [=](const CString& sLine) { SendFile(sLine); });
+        AddCommand("Queue", "", t_d("Show progress of queued lines"),
+                   [=](const CString& sLine) { QueueCommand(sLine); });
+        AddCommand("Cancel", t_d("[user] [network]"),
+                   t_d("Drop the queued lines for a network"),
+                   [=](const CString& sLine) { CancelCommand(sLine); });
+        AddCommand("Pace", t_d("[lines/sec|auto] [burst]"),
+                   t_d("Show or override the rate queued lines are sent at"),
+                   [=](const CString& sLine) { PaceCommand(sLine); });
     }
+
+  private:
+    map<CString, SSendQueue> m_msQueues;
+    CSendRawPacer* m_pPacer = nullptr;
+    std::unique_ptr<SBenchRun> m_pBench;
+    CSendRawBench* m_pBenchTimer = nullptr;
 };
 
+CSendRawPacer::CSendRawPacer(CSendRaw_Mod* pMod)
+    : CTimer(pMod, 1, 0, "SendRawPacer",
+             "Sends queued raw lines to the IRC server") {
+    m_pMod = pMod;
+}
+
+void CSendRawPacer::RunJob() { m_pMod->DrainQueues(); }
+
+CSendRawBench::CSendRawBench(CSendRaw_Mod* pMod)
+    : CTimer(pMod, 1, 0, "SendRawBench",
+             "Injects the next lines of a Bench run") {
+    m_pMod = pMod;
+}
+
+void CSendRawBench::RunJob() { m_pMod->RunBench(); }
+
 template <>
 void TModInfo<CSendRaw_Mod>(CModInfo& Info) {
     Info.SetWikiPage("send_raw");
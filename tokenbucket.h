@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2004-2025 ZNC, see the NOTICE file for details.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Rate limiter shared by the modules that pace what they send: autovoice,
+// fail2ban, invite and send_raw.
+
+#ifndef ZNC_TOKENBUCKET_H
+#define ZNC_TOKENBUCKET_H
+
+#include <algorithm>
+#include <chrono>
+
+// Take() succeeds dBurst times at once and dRate times a second after that
+class CTokenBucket {
+  public:
+    CTokenBucket(double dBurst = 1, double dRate = 1)
+        : m_dBurst(dBurst),
+          m_dRate(dRate),
+          m_dTokens(dBurst),
+          m_tLastFill(std::chrono::steady_clock::now()) {}
+
+    // For limits that can change while the bucket is in use
+    void SetLimits(double dBurst, double dRate) {
+        Fill();
+        m_dBurst = dBurst;
+        m_dRate = dRate;
+        m_dTokens = std::min(m_dTokens, m_dBurst);
+    }
+
+    bool Ready() {
+        Fill();
+        return m_dTokens >= 1;
+    }
+
+    void Take() { m_dTokens -= 1; }
+
+    bool TryTake() {
+        if (!Ready()) return false;
+        Take();
+        return true;
+    }
+
+    // No tokens are added for the time until the next call
+    void Pause() { m_tLastFill = std::chrono::steady_clock::now(); }
+
+    // A full bucket behaves like a new one, so it can be thrown away
+    bool IsFull() {
+        Fill();
+        return m_dTokens >= m_dBurst;
+    }
+
+    double GetTokens() const { return m_dTokens; }
+
+  private:
+    void Fill() {
+        auto tNow = std::chrono::steady_clock::now();
+        double dElapsed =
+            std::chrono::duration<double>(tNow - m_tLastFill).count();
+        m_tLastFill = tNow;
+        m_dTokens = std::min(m_dBurst, m_dTokens + dElapsed * m_dRate);
+    }
+
+    double m_dBurst;
+    double m_dRate;
+    double m_dTokens;
+    std::chrono::steady_clock::time_point m_tLastFill;
+};
+
+#endif  // !ZNC_TOKENBUCKET_H